@@ -0,0 +1,47 @@
+# Print the flash and RAM used by the USB MIDI Host driver object files.
+# Run with cmake -DSIZE_TOOL=<arm-none-eabi-size> -DOBJ_DIR=<dir> -P
+# .text, .rodata and other read-only sections count as flash.
+# .data and .time_critical sections are copied from flash to RAM at
+# startup, so they count as both. .bss counts as RAM only.
+# Match the driver sources by name so application objects such as
+# usb_midi_host_example.c.obj are not counted.
+set(driver_srcs usb_midi_host usb_midi_host_app_driver usb_midi_host_smf usb_midi_host_sysex)
+set(objs)
+foreach(src ${driver_srcs})
+    file(GLOB_RECURSE src_objs ${OBJ_DIR}/${src}.c.obj ${OBJ_DIR}/${src}.c.o ${OBJ_DIR}/${src}.o)
+    list(APPEND objs ${src_objs})
+endforeach()
+if(NOT objs)
+    message(FATAL_ERROR "No USB MIDI Host object files found in ${OBJ_DIR}")
+endif()
+set(total_flash 0)
+set(total_ram 0)
+foreach(obj ${objs})
+    execute_process(COMMAND ${SIZE_TOOL} -A ${obj} OUTPUT_VARIABLE out RESULT_VARIABLE res)
+    if(NOT res EQUAL 0)
+        message(FATAL_ERROR "${SIZE_TOOL} failed on ${obj}")
+    endif()
+    set(flash 0)
+    set(ram 0)
+    string(REPLACE "\n" ";" lines "${out}")
+    foreach(line ${lines})
+        if(line MATCHES "^(\\.[^ ]+) +([0-9]+)")
+            set(section ${CMAKE_MATCH_1})
+            set(bytes ${CMAKE_MATCH_2})
+            if(section MATCHES "^\\.(text|rodata)")
+                math(EXPR flash "${flash} + ${bytes}")
+            elseif(section MATCHES "^\\.(data|time_critical)")
+                math(EXPR flash "${flash} + ${bytes}")
+                math(EXPR ram "${ram} + ${bytes}")
+            elseif(section MATCHES "^\\.(bss|COMMON)")
+                math(EXPR ram "${ram} + ${bytes}")
+            endif()
+        endif()
+    endforeach()
+    get_filename_component(name ${obj} NAME)
+    message("${name}: flash ${flash} bytes, RAM ${ram} bytes")
+    math(EXPR total_flash "${total_flash} + ${flash}")
+    math(EXPR total_ram "${total_ram} + ${ram}")
+endforeach()
+message("USB MIDI Host total: flash ${total_flash} bytes, static RAM ${total_ram} bytes")
+message("Buffers set by tuh_midih_define_limits() are allocated at run time and not included.")
@@ -32,6 +32,9 @@
 
 #include "usb_midi_host.h"
 #include <stdlib.h>
+#if CFG_MIDI_HOST_DEVICE_KEY
+#include "host/hcd.h"
+#endif
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF
 //--------------------------------------------------------------------+
@@ -47,6 +50,118 @@
 #ifndef CFG_TUH_MIDI_EP_BUFSIZE
   #define CFG_TUH_MIDI_EP_BUFSIZE USBH_EPSIZE_BULK_MAX
 #endif
+// CFG_TUH_MIDI_HOT_FUNC(func) wraps the names of the functions on the
+// packet RX and TX paths and CFG_TUH_MIDI_HOT_DATA(group) tags the tables
+// they use. On the RP2040 they are placed in RAM so flash cache misses
+// caused by other code do not add jitter. Elsewhere they compile away.
+#if TU_CHECK_MCU(OPT_MCU_RP2040)
+  #include "pico/platform.h"
+#endif
+#ifndef CFG_TUH_MIDI_HOT_FUNC
+  #if TU_CHECK_MCU(OPT_MCU_RP2040)
+    #define CFG_TUH_MIDI_HOT_FUNC(func) __not_in_flash_func(func)
+  #else
+    #define CFG_TUH_MIDI_HOT_FUNC(func) func
+  #endif
+#endif
+#ifndef CFG_TUH_MIDI_HOT_DATA
+  #if TU_CHECK_MCU(OPT_MCU_RP2040)
+    #define CFG_TUH_MIDI_HOT_DATA(group) __not_in_flash(group)
+  #else
+    #define CFG_TUH_MIDI_HOT_DATA(group)
+  #endif
+#endif
+// Number of contexts (e.g., CPU cores) that may write to the same device
+// at the same time. Each producer gets its own OUT FIFO and its own
+// stream encoder state, so writers never need to take a lock.
+// CFG_TUH_MIDI_PRODUCER_ID() must return the calling producer's index.
+#ifndef CFG_TUH_MIDI_TX_PRODUCERS
+  #define CFG_TUH_MIDI_TX_PRODUCERS 1
+#endif
+#ifndef CFG_TUH_MIDI_PRODUCER_ID
+  #if CFG_TUH_MIDI_TX_PRODUCERS == 1
+    #define CFG_TUH_MIDI_PRODUCER_ID() 0
+  #elif TU_CHECK_MCU(OPT_MCU_RP2040)
+    #define CFG_TUH_MIDI_PRODUCER_ID() get_core_num()
+  #else
+    #error "CFG_TUH_MIDI_TX_PRODUCERS > 1 requires CFG_TUH_MIDI_PRODUCER_ID()"
+  #endif
+#endif
+// CFG_TUH_MIDI_TIME_US() returns a free running 32-bit microsecond count.
+// The driver features that run on time use it as their timebase.
+#ifndef CFG_TUH_MIDI_TIME_US
+  #if TU_CHECK_MCU(OPT_MCU_RP2040)
+    #include "pico/time.h"
+    #define CFG_TUH_MIDI_TIME_US() time_us_32()
+  #endif
+#endif
+#if CFG_MIDI_HOST_TX_SCHEDULE && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_TX_SCHEDULE requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_RX_TAP && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_RX_TAP requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_RX_DEJITTER && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_RX_DEJITTER requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_LATENCY_PROBE && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_LATENCY_PROBE requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_CLOCK_REGEN && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_CLOCK_REGEN requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_TX_MAX_AGE requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_TX_WATCHDOG && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_TX_WATCHDOG requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_SYSEX_HANDSHAKE requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_SYSEX_TIMEOUT requires CFG_TUH_MIDI_TIME_US()"
+#endif
+#if CFG_MIDI_HOST_IDENTITY && !defined(CFG_TUH_MIDI_TIME_US)
+  #error "CFG_MIDI_HOST_IDENTITY requires CFG_TUH_MIDI_TIME_US()"
+#endif
+// How long to wait for the echo of a latency probe before counting it lost
+#ifndef CFG_TUH_MIDI_LATENCY_TIMEOUT_US
+  #define CFG_TUH_MIDI_LATENCY_TIMEOUT_US 1000000
+#endif
+// Default OUT transfer watchdog settings for each device; see
+// tuh_midi_set_tx_timeout()
+#ifndef CFG_TUH_MIDI_TX_TIMEOUT_US
+  #define CFG_TUH_MIDI_TX_TIMEOUT_US 500000
+#endif
+// Retrying is off by default: tuh_edpt_abort_xfer() frees the endpoint
+// even if the host controller driver cannot stop the transfer
+#ifndef CFG_TUH_MIDI_TX_RETRIES
+  #define CFG_TUH_MIDI_TX_RETRIES 0
+#endif
+// A handshake SysEx transfer fails if the receiver sends NAK for the same
+// message more than this many times in a row
+#ifndef CFG_TUH_MIDI_HANDSHAKE_RETRIES
+  #define CFG_TUH_MIDI_HANDSHAKE_RETRIES 3
+#endif
+// The driver takes Identity Replies for this long after the last Identity Request
+#ifndef CFG_TUH_MIDI_IDENTITY_TIMEOUT_US
+  #define CFG_TUH_MIDI_IDENTITY_TIMEOUT_US 1000000
+#endif
+// A SysEx message with no new data for this long has timed out
+#ifndef CFG_TUH_MIDI_SYSEX_TIMEOUT_US
+  #define CFG_TUH_MIDI_SYSEX_TIMEOUT_US 1000000
+#endif
+// The clock regenerator starts measuring the clock period again after
+// a gap this long in the input clock; the default is one clock at 10 BPM
+#ifndef CFG_TUH_MIDI_CLOCK_TIMEOUT_US
+  #define CFG_TUH_MIDI_CLOCK_TIMEOUT_US 250000
+#endif
+// Number of clock and transport events the clock regenerator can hold
+// between midih_xfer_cb() and tuh_midi_task(); a power of 2
+#ifndef CFG_TUH_MIDI_CLOCK_EVENTS
+  #define CFG_TUH_MIDI_CLOCK_EVENTS 8
+#endif
 
 #define MIDI_MAX_DATA_VAL 0x7f
 static struct midih_limits_s {
@@ -65,17 +180,89 @@ typedef struct
   uint8_t baAssocJackID[];   ; ///< A list of associated jacks
 } midi_cs_desc_endpoint_t;
 
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+// Running checksum of one SysEx message
+typedef struct
+{
+  uint8_t candidates;   // bit n is set while the header may match rule n
+  uint8_t rule;         // the matching rule + 1, or 0 if none matches yet
+  uint8_t pos;          // header bytes seen
+  uint8_t sum;          // checksum of the data bytes after the header
+  uint8_t last;         // the last data byte
+  bool has_data;        // there are data bytes after the header
+  uint8_t result;       // TUH_MIDI_CHECKSUM_* result of the last received message
+} midih_checksum_t;
+#endif
+
 typedef struct
 {
   uint8_t buffer[4];
   uint8_t index;
   uint8_t total;
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+  midih_checksum_t checksum; // only used by the write streams
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+  uint32_t sysex_us;    // the last time a write stream added to an open SysEx message
+#endif
 }midi_stream_t;
 
+#if CFG_MIDI_HOST_STATE_CHASE
+typedef struct
+{
+  uint8_t cc[128];
+  uint8_t cc_valid[16];   // bit (n%8) of cc_valid[n/8] is set if cc[n] is valid
+  uint16_t pitch_bend;    // 14-bit value, or 0xFFFF if not valid
+  uint8_t program;        // 0xFF if not valid
+} midih_chan_state_t;
+
+typedef struct
+{
+  uint32_t device_key;    // 0 if this record is not in use
+  uint32_t attach_count;  // value of midih_chase_attach_count when last attached
+  bool attached;
+  midih_chan_state_t chan[CFG_MIDI_HOST_STATE_CHASE_CABLES][16];
+} midih_chase_record_t;
+#endif
+
+#if CFG_MIDI_HOST_RX_STATE
+// Controller state of one received channel. 0xFF (0xFFFF for pitch_bend)
+// means the value has not been received.
+typedef struct
+{
+  uint8_t cc[128];
+  uint8_t poly_pressure[128];
+  uint8_t notes[16];      // bit (n%8) of notes[n/8] is set if note n is held
+  uint16_t pitch_bend;
+  uint8_t channel_pressure;
+  uint8_t program;
+} midih_rx_chan_state_t;
+#endif
+
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+TU_VERIFY_STATIC(CFG_MIDI_HOST_RX_RESERVE_SEGMENTS < 255, "CFG_MIDI_HOST_RX_RESERVE_SEGMENTS must be less than 255");
+TU_VERIFY_STATIC(CFG_MIDI_HOST_RX_SEGMENT_BYTES % 4 == 0, "CFG_MIDI_HOST_RX_SEGMENT_BYTES must be a multiple of 4");
+#define MIDIH_NO_SEGMENT 0xFF
+// A segment of the RX reserve. midih_xfer_cb() borrows and fills it;
+// the reader empties it and gives it back.
+typedef struct
+{
+  volatile uint8_t owner; // dev_addr of the device that borrowed it or 0 if free
+  volatile bool closed;   // set by the writer when it will add no more packets
+  volatile uint16_t wr;   // number of bytes written; only the writer changes this
+  volatile uint16_t rd;   // number of bytes read; only the reader changes this
+  uint8_t buf[CFG_MIDI_HOST_RX_SEGMENT_BYTES];
+} midih_rx_segment_t;
+#endif
+
+typedef struct midih_ops_s midih_ops_t;
+
 typedef struct
 {
   uint8_t dev_addr;
+  uint8_t rhport;
   uint8_t itf_num;
+  midih_ops_t const *ops;
 
   uint8_t ep_in;          // IN endpoint address
   uint8_t ep_out;         // OUT endpoint address
@@ -88,21 +275,171 @@ typedef struct
   // For Stream read()/write() API
   // Messages are always 4 bytes long, queue them for reading and writing so the
   // callers can use the Stream interface with single-byte read/write calls.
+  // There are midih_limits.max_cables write streams per producer.
+#if CFG_MIDI_HOST_STREAM_WRITE
   midi_stream_t *stream_write;
+#endif
+#if CFG_MIDI_HOST_STREAM_READ
   midi_stream_t stream_read;
+  uint16_t rx_sysex_in_progress; // bit n is set if cable n received MIDI_STATUS_SYSEX_START but not MIDI_STATUS_SYSEX_END
+#endif
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM && CFG_MIDI_HOST_STREAM_READ
+  midih_checksum_t rx_checksum[16];
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+  uint16_t rx_sysex_open;       // bit n is set if cable n has a received SysEx message open
+  uint32_t rx_sysex_us[16];     // the last time each cable received part of an open SysEx message
+#endif
+
+  uint8_t tx_next_producer; // the producer write_flush() reads first
+
+#if CFG_MIDI_HOST_RX_SHED
+  uint32_t rx_dropped[TUH_MIDI_NUM_CLASSES]; // received packets dropped by class
+#endif
+
+#if CFG_MIDI_HOST_RX_STATE
+  midih_rx_chan_state_t rx_state[CFG_MIDI_HOST_RX_STATE_CABLES][16];
+#endif
+
+#if CFG_MIDI_HOST_TX_MAX_AGE
+  // Each producer has a ring of the times its queued packets were written,
+  // in step with its OUT FIFO; see tx_ts_buf
+  uint16_t tx_ts_wr[CFG_TUH_MIDI_TX_PRODUCERS]; // only the producer changes this
+  uint16_t tx_ts_rd[CFG_TUH_MIDI_TX_PRODUCERS]; // only write_flush() changes this
+  uint32_t tx_max_age_us;           // 0 if packets never get too old
+  uint32_t tx_cable_max_age_us[16]; // if not 0, used instead of tx_max_age_us
+  uint32_t tx_expired;              // number of packets dropped because they were too old
+#endif
+
+#if CFG_MIDI_HOST_RX_DEJITTER
+  // Received packets held until their release time. midih_xfer_cb()
+  // adds packets and tuh_midi_task() releases them; the indices run freely.
+  struct {
+    uint32_t release_us;
+    uint8_t packet[4];
+  } rx_jit[CFG_MIDI_HOST_RX_DEJITTER];
+  uint16_t rx_jit_wr;
+  uint16_t rx_jit_rd;
+  uint32_t rx_jit_delay_us;  // 0 if the de-jitter buffer is off
+  uint32_t rx_jit_early;     // number of packets released early because the buffer was full
+#endif
+
+#if CFG_MIDI_HOST_LATENCY_PROBE
+  bool probe_pending;
+  bool probe_sysex;       // the pending probe is a SysEx message
+  bool probe_sysex_head;  // the first packet of the echoed probe SysEx was consumed
+  uint8_t probe_head_cable; // the cable of that packet
+  bool probe_note_off;    // the Note Off echo of the matched Note probe is still to come
+  uint16_t probe_seq;
+  uint32_t probe_sent_us;
+  tuh_midi_latency_stats_t latency;
+#endif
+
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+  uint8_t const *hs_data;   // the messages of the handshake transfer
+  uint32_t hs_len;
+  uint32_t hs_pos;          // next byte to queue
+  uint32_t hs_msg_start;    // first byte of the message being sent
+  uint32_t hs_timeout_us;
+  uint32_t hs_sent_us;      // time the last packet of the message was queued
+  uint8_t hs_state;         // one of the MIDIH_HS_* values
+  uint8_t hs_cable;
+  uint8_t hs_naks;          // NAKs in a row for the message being sent
+  bool hs_held;             // hs_head may start a handshake reply
+  uint8_t hs_head[4];
+#endif
+
+#if CFG_MIDI_HOST_IDENTITY
+  uint8_t id_state;         // one of the MIDIH_ID_* values
+  uint8_t id_next_cable;    // the next OUT cable to send the Identity Request on
+  uint8_t id_cable;         // the cable of the reply being taken
+  uint8_t id_replies;       // number of Identity Replies taken
+  uint32_t id_sent_us;      // time the last Identity Request was queued
+  uint8_t id_head[4];       // the packet that may start an Identity Reply
+  uint8_t id_len;
+  uint8_t id_bytes[17];     // the longest Identity Reply
+  bool id_valid;            // identity holds the first reply
+  tuh_midi_identity_t identity;
+#endif
+
+#if CFG_MIDI_HOST_TX_CANCEL
+  // Packet counts of each producer's OUT FIFO, so a cancel can say which
+  // packets it applies to. Only the producer changes tx_written, and only
+  // write_flush() changes tx_read.
+  uint32_t tx_written[CFG_TUH_MIDI_TX_PRODUCERS];
+  uint32_t tx_read[CFG_TUH_MIDI_TX_PRODUCERS];
+  // The cancel request from tuh_midi_tx_cancel(). write_flush() takes it
+  // when tx_cancel_seq differs from tx_cancel_ack.
+  uint16_t tx_cancel_req_mask;
+  uint32_t tx_cancel_req_mark[CFG_TUH_MIDI_TX_PRODUCERS];
+  volatile uint8_t tx_cancel_seq;
+  volatile uint8_t tx_cancel_ack;
+  // Cancel state of write_flush(): packets of the cables in tx_cancel_mask
+  // written before tx_cancel_mark are dropped
+  uint16_t tx_cancel_mask;
+  uint32_t tx_cancel_mark[CFG_TUH_MIDI_TX_PRODUCERS];
+  uint16_t tx_cancel_f7;    // cables that may need a SysEx end after a cancel
+  uint16_t tx_sysex_open;   // cables whose last packet sent was part of an unfinished SysEx
+#endif
+
+#if CFG_MIDI_HOST_TX_WATCHDOG
+  uint32_t tx_xfer_us;      // time the OUT transfer in progress started
+  uint16_t tx_xfer_len;     // its length, so it can be sent again
+  uint8_t tx_retry_count;   // number of times it was sent again
+  uint8_t tx_retries;       // number of times to send a transfer again before dropping the OUT queue
+  uint32_t tx_timeout_us;   // 0 if the watchdog is off for this device
+  uint32_t tx_timeouts;     // number of OUT transfers that timed out
+#endif
+
+#if CFG_MIDI_HOST_TX_REALTIME
+  // Realtime lane; write_flush() sends these packets before the OUT queue.
+  // tuh_midi_packet_write_realtime() is the producer and write_flush() is
+  // the consumer. The indices run freely.
+  uint8_t tx_rt[CFG_MIDI_HOST_TX_REALTIME][4];
+  volatile uint8_t tx_rt_wr;
+  volatile uint8_t tx_rt_rd;
+#endif
+
+#if CFG_MIDI_HOST_TX_SCHEDULE
+  // OUT packets waiting for their due time. This is a ring sorted by due
+  // time; tx_sched_head is the index of the earliest packet.
+  struct {
+    uint32_t due_us;
+    uint8_t packet[4];
+  } tx_sched[CFG_MIDI_HOST_TX_SCHEDULE];
+  uint16_t tx_sched_head;
+  uint16_t tx_sched_count;
+  // Output latency compensation; scheduled packets are sent this much early
+  int32_t tx_offset_us;
+  int32_t tx_cable_offset_us[16];
+#endif
 
   /*------------- From this point, data is not cleared by bus reset -------------*/
-  // Endpoint FIFOs
+  // Endpoint FIFOs; one OUT FIFO per producer
   tu_fifo_t rx_ff;
-  tu_fifo_t tx_ff;
+  tu_fifo_t tx_ff[CFG_TUH_MIDI_TX_PRODUCERS];
  
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  // Segments borrowed from the RX reserve in the order they were filled.
+  // This is a single producer single consumer queue; midih_xfer_cb()
+  // is the producer and the reader is the consumer.
+  uint8_t rx_seg_q[CFG_MIDI_HOST_RX_RESERVE_SEGMENTS+1];
+  volatile uint8_t rx_seg_q_wr; // only the writer changes this
+  volatile uint8_t rx_seg_q_rd; // only the reader changes this
+  uint8_t rx_seg_cur;           // the segment the writer is filling or MIDIH_NO_SEGMENT
+  volatile uint8_t rx_seg_given; // segments given back; only the reader changes this
+  uint8_t rx_seg_given_seen;     // rx_seg_given when the writer last counted free segments
+#endif
 
   uint8_t *rx_ff_buf;
   uint8_t *tx_ff_buf;
+#if CFG_MIDI_HOST_TX_MAX_AGE
+  uint32_t *tx_ts_buf;  // midih_limits.midi_tx_buf/4 entries per producer
+#endif
 
   #if CFG_FIFO_MUTEX
   osal_mutex_def_t rx_ff_mutex;
-  osal_mutex_def_t tx_ff_mutex;
+  osal_mutex_def_t tx_ff_mutex[CFG_TUH_MIDI_TX_PRODUCERS];
   #endif
 
   // Endpoint Transfer buffer
@@ -111,6 +448,21 @@ typedef struct
 
   bool configured;
 
+#if CFG_MIDI_HOST_DEVICE_KEY
+  uint32_t device_key;
+  // String descriptor buffer for the serial number; only
+  // the first (sizeof(serial_desc)-2)/2 characters are used for the key
+  CFG_TUSB_MEM_ALIGN uint16_t serial_desc[32];
+#endif
+
+#if CFG_MIDI_HOST_STATE_CHASE
+  midih_chase_record_t *chase;  // NULL if the device has no record
+  bool replaying;
+  uint8_t replay_cable;
+  uint8_t replay_chan;
+  uint8_t replay_item;
+#endif
+
 #if CFG_MIDI_HOST_DEVSTRINGS
 #define MAX_STRING_INDICES 32
   uint8_t all_string_indices[MAX_STRING_INDICES];
@@ -138,14 +490,239 @@ typedef struct
 
 static midih_interface_t _midi_host[CFG_TUH_DEVICE_MAX];
 
-static midih_interface_t *get_midi_host(uint8_t dev_addr)
+// Put the non-zero packets of an IN transfer in the RX FIFO. Packets whose
+// cable numbers cannot be valid are either fixed or passed as is depending
+// on the device type. Returns the number of packets queued.
+static uint32_t rx_queue_single(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets);
+static uint32_t rx_queue_multi(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets);
+static uint32_t rx_queue_quirky(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets);
+#if CFG_MIDI_HOST_STREAM_READ
+static uint32_t stream_read_single(midih_interface_t *p_midi_host, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize);
+static uint32_t stream_read_multi(midih_interface_t *p_midi_host, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize);
+#define MIDIH_OPS_STREAM_READ(func) , func
+#else
+#define MIDIH_OPS_STREAM_READ(func)
+#endif
+
+// midih_open() picks the RX implementations that fit the device
+struct midih_ops_s
+{
+  uint32_t (*rx_queue)(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets);
+#if CFG_MIDI_HOST_STREAM_READ
+  uint32_t (*stream_read)(midih_interface_t *p_midi_host, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize);
+#endif
+};
+
+// Exactly one IN cable
+static const midih_ops_t CFG_TUH_MIDI_HOT_DATA("midih_ops") midih_ops_single = { rx_queue_single MIDIH_OPS_STREAM_READ(stream_read_single) };
+// More than one IN cable
+static const midih_ops_t CFG_TUH_MIDI_HOT_DATA("midih_ops") midih_ops_multi = { rx_queue_multi MIDIH_OPS_STREAM_READ(stream_read_multi) };
+// The IN endpoint does not say how many cables it has, so packet
+// cable numbers cannot be checked
+static const midih_ops_t CFG_TUH_MIDI_HOT_DATA("midih_ops") midih_ops_quirky = { rx_queue_quirky MIDIH_OPS_STREAM_READ(stream_read_multi) };
+
+#if CFG_MIDI_HOST_DEVICE_KEY
+// Open addressing hash table that maps device keys to dev_addr.
+// It must have at least twice as many entries as there are devices
+// and the number of entries must be a power of 2.
+// By default it is the smallest power of 2 that is at least 16 and at
+// least twice CFG_TUH_DEVICE_MAX.
+#ifndef MIDIH_KEY_TABLE_SIZE
+  #if 2*CFG_TUH_DEVICE_MAX <= 16
+    #define MIDIH_KEY_TABLE_SIZE 16
+  #elif 2*CFG_TUH_DEVICE_MAX <= 32
+    #define MIDIH_KEY_TABLE_SIZE 32
+  #elif 2*CFG_TUH_DEVICE_MAX <= 64
+    #define MIDIH_KEY_TABLE_SIZE 64
+  #elif 2*CFG_TUH_DEVICE_MAX <= 128
+    #define MIDIH_KEY_TABLE_SIZE 128
+  #elif 2*CFG_TUH_DEVICE_MAX <= 256
+    #define MIDIH_KEY_TABLE_SIZE 256
+  #else
+    #define MIDIH_KEY_TABLE_SIZE 512
+  #endif
+#endif
+TU_VERIFY_STATIC(MIDIH_KEY_TABLE_SIZE >= 2*CFG_TUH_DEVICE_MAX, "MIDIH_KEY_TABLE_SIZE is too small");
+TU_VERIFY_STATIC((MIDIH_KEY_TABLE_SIZE & (MIDIH_KEY_TABLE_SIZE - 1)) == 0, "MIDIH_KEY_TABLE_SIZE must be a power of 2");
+static struct {
+  uint32_t device_key; // 0 if this entry is empty
+  uint8_t dev_addr;
+} midih_key_table[MIDIH_KEY_TABLE_SIZE];
+#endif
+
+#if CFG_MIDI_HOST_RX_SHED
+// For each class, drop received packets when less than level/16 of the
+// RX buffer space is free; 0 means only drop when there is no room at all
+static uint8_t midih_rx_shed_level[TUH_MIDI_NUM_CLASSES] = {
+  [TUH_MIDI_CLASS_REALTIME] = 0,
+  [TUH_MIDI_CLASS_NOTE] = 0,
+  [TUH_MIDI_CLASS_SYSTEM] = 0,
+  [TUH_MIDI_CLASS_CONTROL] = 2,
+  [TUH_MIDI_CLASS_PITCH_BEND] = 3,
+  [TUH_MIDI_CLASS_AFTERTOUCH] = 4,
+  [TUH_MIDI_CLASS_ACTIVE_SENSING] = 6,
+};
+#endif
+
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+// RX reserve shared by all devices
+static midih_rx_segment_t _midi_rx_reserve[CFG_MIDI_HOST_RX_RESERVE_SEGMENTS];
+// Segments no device has borrowed, as the writer last counted them. Only
+// the writer changes this; the readers count the segments they give back
+// in rx_seg_given and rx_reserve_collect() adds them.
+static uint8_t midih_rx_seg_free;
+#endif
+
+#if CFG_MIDI_HOST_STATE_CHASE
+// The state records outlive the dev_addr so they are not part of _midi_host
+static midih_chase_record_t _midi_chase[CFG_TUH_DEVICE_MAX];
+static uint32_t midih_chase_attach_count;
+#endif
+
+#if CFG_MIDI_HOST_TX_REALTIME
+TU_VERIFY_STATIC((CFG_MIDI_HOST_TX_REALTIME & (CFG_MIDI_HOST_TX_REALTIME - 1)) == 0 && CFG_MIDI_HOST_TX_REALTIME <= 128,
+    "CFG_MIDI_HOST_TX_REALTIME must be a power of 2 up to 128");
+#endif
+
+#if CFG_MIDI_HOST_CLOCK_REGEN
+TU_VERIFY_STATIC((CFG_TUH_MIDI_CLOCK_EVENTS & (CFG_TUH_MIDI_CLOCK_EVENTS - 1)) == 0 && CFG_TUH_MIDI_CLOCK_EVENTS <= 128,
+    "CFG_TUH_MIDI_CLOCK_EVENTS must be a power of 2 up to 128");
+typedef struct
+{
+  uint8_t dev_addr;     // 0 if this output is not in use
+  uint8_t cable;
+  uint8_t mul;
+  uint8_t div;
+  uint8_t div_count;    // input clocks since the start of the group
+  uint8_t sent;         // clocks sent in the group; a group is mul clocks per div input clocks
+  uint32_t group_us;    // time of the input clock that started the group
+} midih_clock_output_t;
+
+// The clock regenerator. midih_xfer_cb() tracks the input clock and queues
+// clock and transport events; tuh_midi_task() sends them to the outputs.
+static struct {
+  uint8_t dev_addr;     // input device or 0
+  uint8_t cable;
+  bool have_input;      // in_last_us is valid
+  uint32_t delay_us;
+  uint32_t in_last_us;  // arrival time of the last input clock
+  uint32_t smooth_us;   // smoothed time of the last input clock
+  uint32_t period_q8;   // smoothed clock period in 1/256 microseconds, or 0 if not known
+  struct {
+    uint32_t due_us;
+    uint8_t status;
+    uint8_t data[2];
+  } event[CFG_TUH_MIDI_CLOCK_EVENTS];
+  volatile uint8_t event_wr;
+  volatile uint8_t event_rd;
+  midih_clock_output_t out[CFG_MIDI_HOST_CLOCK_REGEN];
+} midih_clock;
+#endif
+
+static midih_interface_t *CFG_TUH_MIDI_HOT_FUNC(get_midi_host)(uint8_t dev_addr)
 {
   TU_VERIFY(dev_addr >0 && dev_addr <= CFG_TUH_DEVICE_MAX);
   return (_midi_host + dev_addr - 1);
 }
 
+// Return the calling producer's OUT FIFO
+static inline tu_fifo_t *get_tx_ff(midih_interface_t *p_midi_host)
+{
+  return &p_midi_host->tx_ff[CFG_TUH_MIDI_PRODUCER_ID()];
+}
+
+// Queue a packet in the OUT FIFO tx_ff of the device.
+// Returns the number of bytes queued.
+static inline uint16_t CFG_TUH_MIDI_HOT_FUNC(tx_ff_write)(midih_interface_t *p_midi_host, tu_fifo_t *tx_ff, uint8_t const *packet)
+{
+#if CFG_MIDI_HOST_TX_MAX_AGE || CFG_MIDI_HOST_TX_CANCEL
+  uint8_t const producer = (uint8_t)(tx_ff - p_midi_host->tx_ff);
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE
+  // The time goes in first, so write_flush() never sees a packet without it.
+  // Without room, ts[wr] is still the time of the oldest packet.
+  if (tu_fifo_remaining(tx_ff) < 4)
+    return 0;
+  uint16_t const entries = (uint16_t)(midih_limits.midi_tx_buf / 4);
+  uint16_t wr = p_midi_host->tx_ts_wr[producer];
+  p_midi_host->tx_ts_buf[producer*entries + wr] = CFG_TUH_MIDI_TIME_US();
+#endif
+  uint16_t const count = tu_fifo_write_n(tx_ff, packet, 4);
+  if (count == 4)
+  {
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    p_midi_host->tx_ts_wr[producer] = (uint16_t)(wr + 1 == entries ? 0 : wr + 1);
+#endif
+#if CFG_MIDI_HOST_TX_CANCEL
+    ++p_midi_host->tx_written[producer];
+#endif
+  }
+  (void)p_midi_host;
+  return count;
+}
+
+// Return the number of bytes in all of the OUT FIFOs
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(tx_ff_count)(midih_interface_t *p_midi_host)
+{
+  uint32_t count = 0;
+  for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
+  {
+    count += tu_fifo_count(&p_midi_host->tx_ff[producer]);
+  }
+  return count;
+}
+
 //------------- Internal prototypes -------------//
 static uint32_t write_flush(uint8_t dev_addr, midih_interface_t* midi);
+#if CFG_MIDI_HOST_TX_WATCHDOG
+static inline void tx_watchdog_start(midih_interface_t *midi, uint16_t len);
+#endif
+static void config_complete(uint8_t dev_addr, uint8_t itf_num);
+#if CFG_MIDI_HOST_DEVICE_KEY
+static void key_table_remove(uint32_t device_key, uint8_t dev_addr);
+#endif
+#if CFG_MIDI_HOST_LATENCY_PROBE
+static bool latency_match(midih_interface_t *p_midi_host, uint8_t const *buf);
+static inline bool latency_match_note_off(midih_interface_t *p_midi_host, uint8_t const *buf);
+#endif
+#if CFG_MIDI_HOST_CLOCK_REGEN
+static void clock_input(uint8_t const *buf);
+static void clock_device_closed(uint8_t dev_addr);
+#endif
+#if CFG_MIDI_HOST_RX_STATE
+static void rx_state_reset(midih_interface_t *p_midi_host);
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+enum
+{
+  MIDIH_HS_IDLE,
+  MIDIH_HS_SENDING,   // queueing the packets of a message
+  MIDIH_HS_ENDING,    // aborted; waiting for room for the F7 that ends the message
+  MIDIH_HS_WAITING,   // the message is queued; waiting for the reply
+  MIDIH_HS_PAUSED,    // the receiver sent WAIT
+};
+static bool hs_match_head(midih_interface_t *p_midi_host, uint8_t const *buf);
+static bool hs_match_tail(midih_interface_t *p_midi_host, uint8_t const *buf);
+static void hs_continue(midih_interface_t *p_midi_host);
+static void hs_end(midih_interface_t *p_midi_host);
+static void hs_finish(midih_interface_t *p_midi_host, uint8_t result);
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+enum
+{
+  MIDIH_ID_IDLE,
+  MIDIH_ID_WAITING,   // Identity Requests were sent; waiting for replies
+  MIDIH_ID_HEAD,      // id_head holds the first packet of what may be a reply
+  MIDIH_ID_BODY,      // taking the rest of a reply
+};
+static void id_send(midih_interface_t *p_midi_host);
+static bool id_match_head(midih_interface_t *p_midi_host, uint8_t const *buf);
+static bool id_match_tail(midih_interface_t *p_midi_host, uint8_t const *buf);
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+static void chase_capture(midih_interface_t *p_midi_host, uint8_t const packet[4]);
+static void chase_replay_continue(midih_interface_t *p_midi_host);
+#endif
 
 static void midih_freeall(void)
 {
@@ -163,11 +740,20 @@ static void midih_freeall(void)
       free (p_midi_host->tx_ff_buf);
       p_midi_host->tx_ff_buf = NULL;
     }
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    if (p_midi_host->tx_ts_buf != NULL)
+    {
+      free(p_midi_host->tx_ts_buf);
+      p_midi_host->tx_ts_buf = NULL;
+    }
+#endif
+#if CFG_MIDI_HOST_STREAM_WRITE
     if (p_midi_host->stream_write != NULL)
     {
       free(p_midi_host->stream_write);
       p_midi_host->stream_write = NULL;
     }
+#endif
   }
 }
 
@@ -178,7 +764,9 @@ void tuh_midih_define_limits(size_t midi_rx_buffer_bytes, size_t midi_tx_buffer_
 {
   // prevent memory leak in case midih_init() was called before this function
   midih_freeall();
-  midih_limits.midi_rx_buf = midi_rx_buffer_bytes;
+  // rx_ff holds whole packets only, so a packet never wraps
+  // around the end of the buffer; see tuh_midi_packet_read_peek()
+  midih_limits.midi_rx_buf = midi_rx_buffer_bytes & ~(size_t)3;
   midih_limits.midi_tx_buf = midi_tx_buffer_bytes;
   midih_limits.max_cables = max_cables;
 }
@@ -186,22 +774,52 @@ void tuh_midih_define_limits(size_t midi_rx_buffer_bytes, size_t midi_tx_buffer_
 bool midih_init(void)
 {
   tu_memclr(&_midi_host, sizeof(_midi_host));
+#if CFG_MIDI_HOST_DEVICE_KEY
+  tu_memclr(&midih_key_table, sizeof(midih_key_table));
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+  tu_memclr(&_midi_chase, sizeof(_midi_chase));
+  midih_chase_attach_count = 0;
+#endif
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  tu_memclr(&_midi_rx_reserve, sizeof(_midi_rx_reserve));
+  midih_rx_seg_free = CFG_MIDI_HOST_RX_RESERVE_SEGMENTS;
+#endif
   // config fifos
   for (int inst = 0; inst < CFG_TUH_DEVICE_MAX; inst++)
   {
     midih_interface_t *p_midi_host = &_midi_host[inst];
+    p_midi_host->ops = &midih_ops_multi;
+#if CFG_MIDI_HOST_RX_STATE
+    rx_state_reset(p_midi_host);
+#endif
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+    p_midi_host->rx_seg_cur = MIDIH_NO_SEGMENT;
+#endif
     p_midi_host->rx_ff_buf = malloc(midih_limits.midi_rx_buf);
-    p_midi_host->tx_ff_buf = malloc(midih_limits.midi_tx_buf);
-    p_midi_host->stream_write = malloc(midih_limits.max_cables * sizeof(midi_stream_t));
-    TU_ASSERT((p_midi_host->rx_ff_buf != NULL && p_midi_host->tx_ff_buf != NULL && p_midi_host->stream_write != NULL), 0);
-    tu_memclr(p_midi_host->stream_write, sizeof(*(p_midi_host->stream_write))*midih_limits.max_cables);
+    p_midi_host->tx_ff_buf = malloc(midih_limits.midi_tx_buf * CFG_TUH_MIDI_TX_PRODUCERS);
+    TU_ASSERT((p_midi_host->rx_ff_buf != NULL && p_midi_host->tx_ff_buf != NULL), 0);
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    p_midi_host->tx_ts_buf = malloc((midih_limits.midi_tx_buf / 4) * CFG_TUH_MIDI_TX_PRODUCERS * sizeof(uint32_t));
+    TU_ASSERT(p_midi_host->tx_ts_buf != NULL, 0);
+#endif
+#if CFG_MIDI_HOST_STREAM_WRITE
+    p_midi_host->stream_write = malloc(midih_limits.max_cables * CFG_TUH_MIDI_TX_PRODUCERS * sizeof(midi_stream_t));
+    TU_ASSERT(p_midi_host->stream_write != NULL, 0);
+    tu_memclr(p_midi_host->stream_write, sizeof(*(p_midi_host->stream_write))*midih_limits.max_cables*CFG_TUH_MIDI_TX_PRODUCERS);
+#endif
     tu_fifo_config(&p_midi_host->rx_ff, p_midi_host->rx_ff_buf, midih_limits.midi_rx_buf, 1, false); // true, true
-    tu_fifo_config(&p_midi_host->tx_ff, p_midi_host->tx_ff_buf, midih_limits.midi_tx_buf, 1, false); // OBVS.
-
   #if CFG_FIFO_MUTEX
     tu_fifo_config_mutex(&p_midi_host->rx_ff, NULL, osal_mutex_create(&p_midi_host->rx_ff_mutex));
-    tu_fifo_config_mutex(&p_midi_host->tx_ff, osal_mutex_create(&p_midi_host->tx_ff_mutex), NULL);
   #endif
+    for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
+    {
+      tu_fifo_config(&p_midi_host->tx_ff[producer], p_midi_host->tx_ff_buf + producer*midih_limits.midi_tx_buf,
+                     midih_limits.midi_tx_buf, 1, false); // OBVS.
+    #if CFG_FIFO_MUTEX
+      tu_fifo_config_mutex(&p_midi_host->tx_ff[producer], osal_mutex_create(&p_midi_host->tx_ff_mutex[producer]), NULL);
+    #endif
+    }
   }
   return true;
 }
@@ -211,261 +829,877 @@ bool midih_deinit()
   midih_freeall();
   return true;
 }
-bool midih_xfer_cb(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+// some devices send back all zero packets even if there is no data ready
+static inline bool rx_packet_is_empty(uint8_t const *buf)
 {
-  (void)result;
-  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
-  if ( ep_addr == p_midi_host->ep_in)
+  uint32_t packet;
+  memcpy(&packet, buf, 4);
+  return packet == 0;
+}
+
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+static inline uint8_t rx_seg_q_next(uint8_t idx)
+{
+  return (uint8_t)((idx + 1) % (CFG_MIDI_HOST_RX_RESERVE_SEGMENTS+1));
+}
+
+// Queue a packet that does not fit in rx_ff to a reserve segment.
+// Only midih_xfer_cb() calls this. Returns false if the reserve is empty.
+static bool CFG_TUH_MIDI_HOT_FUNC(rx_reserve_write)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  if (p_midi_host->rx_seg_cur == MIDIH_NO_SEGMENT)
   {
-    // receive new data if available
-    uint32_t packets_queued = 0;
-    if (xferred_bytes)
+    uint8_t idx;
+    for (idx = 0; idx < CFG_MIDI_HOST_RX_RESERVE_SEGMENTS && _midi_rx_reserve[idx].owner != 0; idx++) {}
+    if (idx == CFG_MIDI_HOST_RX_RESERVE_SEGMENTS)
     {
-      // put in the RX FIFO only non-zero MIDI IN 4-byte packets
-      uint8_t* buf = p_midi_host->epin_buf;
-      uint32_t npackets = xferred_bytes / 4;
-      uint32_t packet_num;
-      for (packet_num = 0; packet_num < npackets; packet_num++)
-      {
-        // some devices send back all zero packets even if there is no data ready
-        uint32_t packet = (uint32_t)((*buf)<<24) | ((uint32_t)(*(buf+1))<<16) | ((uint32_t)(*(buf+2))<<8) | ((uint32_t)(*(buf+3)));
-        if (packet != 0)
-        {
-          tu_fifo_write_n(&p_midi_host->rx_ff, buf, 4);
-          ++packets_queued;
-          TU_LOG3("MIDI RX=%08x\r\n", packet);
-        }
-        buf += 4;
-      }
-      // invoke receive callback if available
-      if (tuh_midi_rx_cb && packets_queued)
-      {
-        tuh_midi_rx_cb(dev_addr, packets_queued);
-      }
+      TU_LOG1("MIDI RX reserve is empty; packet dropped\r\n");
+      return false;
     }
-
-    TU_LOG2("Requesting poll IN endpoint %d\r\n", p_midi_host->ep_in);
-    TU_ASSERT(usbh_edpt_xfer(p_midi_host->dev_addr, p_midi_host->ep_in, p_midi_host->epin_buf, p_midi_host->ep_in_max), 0);
+    // The segment is not in any queue, so it is safe to reset the reader's count too
+    midih_rx_segment_t *seg = &_midi_rx_reserve[idx];
+    seg->wr = 0;
+    seg->rd = 0;
+    seg->closed = false;
+    seg->owner = p_midi_host->dev_addr;
+    --midih_rx_seg_free;
+    p_midi_host->rx_seg_cur = idx;
+    p_midi_host->rx_seg_q[p_midi_host->rx_seg_q_wr] = idx;
+    p_midi_host->rx_seg_q_wr = rx_seg_q_next(p_midi_host->rx_seg_q_wr);
   }
-  else if ( ep_addr == p_midi_host->ep_out )
+  midih_rx_segment_t *seg = &_midi_rx_reserve[p_midi_host->rx_seg_cur];
+  memcpy(seg->buf + seg->wr, buf, 4);
+  seg->wr += 4;
+  if (seg->wr == CFG_MIDI_HOST_RX_SEGMENT_BYTES)
   {
-    if (0 == write_flush(dev_addr, p_midi_host))
-    {
-      // If there is no data left, a ZLP should be sent if
-      // xferred_bytes is multiple of EP size and not zero
-      if ( !tu_fifo_count(&p_midi_host->tx_ff) && xferred_bytes && (0 == (xferred_bytes % p_midi_host->ep_out_max)) )
-      {
-        if ( usbh_edpt_claim(dev_addr, p_midi_host->ep_out) )
-        {
-          TU_ASSERT(usbh_edpt_xfer(dev_addr, p_midi_host->ep_out, XFER_RESULT_SUCCESS, 0));
-        }
-      }
-    }
-    if (tuh_midi_tx_cb)
-    {
-      tuh_midi_tx_cb(dev_addr);
-    }
+    seg->closed = true;
+    p_midi_host->rx_seg_cur = MIDIH_NO_SEGMENT;
   }
-
   return true;
 }
 
-void midih_close(uint8_t dev_addr)
+// Close the segment the writer is filling at the end of each transfer
+// so the reader can give it back as soon as it has read it.
+static inline void rx_reserve_close(midih_interface_t *p_midi_host)
 {
-  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  if (p_midi_host == NULL)
-    return;
-  if (tuh_midi_umount_cb)
-    tuh_midi_umount_cb(dev_addr, 0);
-  tu_fifo_clear(&p_midi_host->rx_ff);
-  tu_fifo_clear(&p_midi_host->tx_ff);
-  p_midi_host->ep_in = 0;
-  p_midi_host->ep_in_max = 0;
-  p_midi_host->ep_out = 0;
-  p_midi_host->ep_out_max = 0;
-  p_midi_host->itf_num = 0;
-  p_midi_host->num_cables_rx = 0;
-  p_midi_host->num_cables_tx = 0;
-  p_midi_host->dev_addr = 255; // invalid
-  p_midi_host->configured = false;
-  tu_memclr(&p_midi_host->stream_read, sizeof(p_midi_host->stream_read));
-  tu_memclr(p_midi_host->stream_write, sizeof(p_midi_host->stream_write)*midih_limits.max_cables);
+  if (p_midi_host->rx_seg_cur != MIDIH_NO_SEGMENT)
+  {
+    _midi_rx_reserve[p_midi_host->rx_seg_cur].closed = true;
+    p_midi_host->rx_seg_cur = MIDIH_NO_SEGMENT;
+  }
 }
 
-//--------------------------------------------------------------------+
-// Enumeration
-//--------------------------------------------------------------------+
-bool midih_open(uint8_t rhport, uint8_t dev_addr, tusb_desc_interface_t const *desc_itf, uint16_t max_len)
+// Return the oldest borrowed segment that has unread packets or NULL if
+// there is none. Give back every segment the reader has emptied along the way.
+static midih_rx_segment_t *CFG_TUH_MIDI_HOT_FUNC(rx_reserve_front)(midih_interface_t *p_midi_host)
 {
-  (void) rhport;
-
-  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  while (p_midi_host->rx_seg_q_rd != p_midi_host->rx_seg_q_wr)
+  {
+    midih_rx_segment_t *seg = &_midi_rx_reserve[p_midi_host->rx_seg_q[p_midi_host->rx_seg_q_rd]];
+    // read closed before wr so a packet written just before closing is not missed
+    bool closed = seg->closed;
+    if (seg->rd != seg->wr)
+      return seg;
+    if (!closed)
+      return NULL;
+    p_midi_host->rx_seg_q_rd = rx_seg_q_next(p_midi_host->rx_seg_q_rd);
+    seg->owner = 0;
+    ++p_midi_host->rx_seg_given;
+  }
+  return NULL;
+}
 
-  TU_VERIFY(p_midi_host != NULL);
-#if CFG_MIDI_HOST_DEVSTRINGS
-  p_midi_host->num_string_indices = 0;
-#endif
-  TU_VERIFY(TUSB_CLASS_AUDIO == desc_itf->bInterfaceClass);
-  // There can be just a MIDI interface or an audio and a MIDI interface. Only open the MIDI interface
-  uint8_t const *p_desc = (uint8_t const *) desc_itf;
-  uint16_t len_parsed = 0;
-  if (AUDIO_SUBCLASS_CONTROL == desc_itf->bInterfaceSubClass)
+// Add the segments the readers gave back since the last count to
+// midih_rx_seg_free. Only the writer calls this, once per IN transfer.
+static void CFG_TUH_MIDI_HOT_FUNC(rx_reserve_collect)(void)
+{
+  for (int inst = 0; inst < CFG_TUH_DEVICE_MAX; inst++)
   {
-#if CFG_MIDI_HOST_DEVSTRINGS
-    // Keep track of any string descriptor that might be here
-    if (desc_itf->iInterface != 0)
-        p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = desc_itf->iInterface;
+    midih_interface_t *p_midi_host = &_midi_host[inst];
+    uint8_t const given = p_midi_host->rx_seg_given;
+    midih_rx_seg_free = (uint8_t)(midih_rx_seg_free + (uint8_t)(given - p_midi_host->rx_seg_given_seen));
+    p_midi_host->rx_seg_given_seen = given;
+  }
+}
 #endif
-    // This driver does not support audio streaming. However, if this is the audio control interface
-    // there might be a MIDI interface following it. Search through every descriptor until a MIDI
-    // interface is found or the end of the descriptor is found
-    while (len_parsed < max_len && (desc_itf->bInterfaceClass != TUSB_CLASS_AUDIO || desc_itf->bInterfaceSubClass != AUDIO_SUBCLASS_MIDI_STREAMING))
-    {
-      len_parsed += desc_itf->bLength;
-      p_desc = tu_desc_next(p_desc);
-      desc_itf = (tusb_desc_interface_t const *)p_desc;
-    }
 
-    TU_VERIFY(TUSB_CLASS_AUDIO == desc_itf->bInterfaceClass);
-  }
-  TU_VERIFY(AUDIO_SUBCLASS_MIDI_STREAMING == desc_itf->bInterfaceSubClass);
-  len_parsed += desc_itf->bLength;
+#if CFG_MIDI_HOST_RX_TAP
+TU_VERIFY_STATIC((CFG_MIDI_HOST_RX_TAP & (CFG_MIDI_HOST_RX_TAP - 1)) == 0, "CFG_MIDI_HOST_RX_TAP must be a power of 2");
+// Copies of received packets with their arrival times. This is a single
+// producer single consumer ring; midih_xfer_cb() is the producer and
+// tuh_midi_rx_tap_read() is the consumer. The indices run freely.
+static struct {
+  tuh_midi_rx_event_t event[CFG_MIDI_HOST_RX_TAP];
+  volatile uint32_t wr;
+  volatile uint32_t rd;
+  volatile bool enabled;
+  volatile uint32_t dropped;
+} midih_rx_tap;
 
-#if CFG_MIDI_HOST_DEVSTRINGS
-  // Keep track of any string descriptor that might be here
-  if (desc_itf->iInterface != 0)
-      p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = desc_itf->iInterface;
+static void CFG_TUH_MIDI_HOT_FUNC(rx_tap_write)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  uint32_t wr = midih_rx_tap.wr;
+  if (wr - midih_rx_tap.rd >= CFG_MIDI_HOST_RX_TAP)
+  {
+    // never wait for the consumer here
+    ++midih_rx_tap.dropped;
+    return;
+  }
+  tuh_midi_rx_event_t *event = &midih_rx_tap.event[wr % CFG_MIDI_HOST_RX_TAP];
+  event->time_us = CFG_TUH_MIDI_TIME_US();
+  event->dev_addr = p_midi_host->dev_addr;
+  memcpy(event->packet, buf, 4);
+  midih_rx_tap.wr = wr + 1;
+}
 #endif
-  p_desc = tu_desc_next(p_desc);
-  TU_LOG1("MIDI opening Interface %u (addr = %u)\r\n", desc_itf->bInterfaceNumber, dev_addr);
-  // Find out if getting the MIDI class specific interface header or an endpoint descriptor
-  // or a class-specific endpoint descriptor
-  // Jack descriptors or element descriptors must follow the cs interface header,
-  // but this driver does not support devices that contain element descriptors
 
-  // assume it is an interface header
-  midi_desc_header_t const *p_mdh = (midi_desc_header_t const *)p_desc;
-  TU_VERIFY((p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE && p_mdh->bDescriptorSubType == MIDI_CS_INTERFACE_HEADER) || 
-    (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT && p_mdh->bDescriptorSubType == MIDI_CS_ENDPOINT_GENERAL) ||
-    p_mdh->bDescriptorType == TUSB_DESC_ENDPOINT);
+// Return true if the driver consumed the packet itself, so it
+// must not be passed to the application
+static inline bool rx_intercept(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+  if (p_midi_host->hs_state >= MIDIH_HS_WAITING && hs_match_head(p_midi_host, buf))
+    return true;
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+  if (p_midi_host->id_state == MIDIH_ID_WAITING && id_match_head(p_midi_host, buf))
+    return true;
+#endif
+#if CFG_MIDI_HOST_LATENCY_PROBE
+  if (p_midi_host->probe_pending && latency_match(p_midi_host, buf))
+    return true;
+  if (p_midi_host->probe_note_off && latency_match_note_off(p_midi_host, buf))
+    return true;
+#endif
+  (void)p_midi_host;
+  (void)buf;
+  return false;
+}
 
-  uint8_t prev_ep_addr = 0; // the CS endpoint descriptor is associated with the previous endpoint descrptor
-  p_midi_host->itf_num = desc_itf->bInterfaceNumber;
-  tusb_desc_endpoint_t const* in_desc = NULL;
-  tusb_desc_endpoint_t const* out_desc = NULL;
-  while (len_parsed < max_len)
+#if CFG_MIDI_HOST_RX_SHED
+// Return the shedding class of a received packet. Like tuh_midi_stream_read(),
+// this ignores the CIN field and goes by the status byte.
+static inline uint8_t rx_packet_class(uint8_t const *buf)
+{
+  uint8_t const status = buf[1];
+  if (status >= MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+    return status == MIDI_STATUS_SYSREAL_ACTIVE_SENSING ? TUH_MIDI_CLASS_ACTIVE_SENSING : TUH_MIDI_CLASS_REALTIME;
+  switch (status >> 4)
   {
-    TU_VERIFY((p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE) || 
-      (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT && p_mdh->bDescriptorSubType == MIDI_CS_ENDPOINT_GENERAL) ||
-      p_mdh->bDescriptorType == TUSB_DESC_ENDPOINT);
+    case MIDI_CIN_NOTE_OFF:
+    case MIDI_CIN_NOTE_ON:
+      return TUH_MIDI_CLASS_NOTE;
+    case MIDI_CIN_CONTROL_CHANGE:
+    case MIDI_CIN_PROGRAM_CHANGE:
+      return TUH_MIDI_CLASS_CONTROL;
+    case MIDI_CIN_PITCH_BEND_CHANGE:
+      return TUH_MIDI_CLASS_PITCH_BEND;
+    case MIDI_CIN_POLY_KEYPRESS:
+    case MIDI_CIN_CHANNEL_PRESSURE:
+      return TUH_MIDI_CLASS_AFTERTOUCH;
+    default:
+      return TUH_MIDI_CLASS_SYSTEM; // SysEx data and system common messages
+  }
+}
 
-    if (p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE) {
-      // The USB host doesn't really need this information unless it uses
-      // the string descriptor for a jack or Element
+// Return the number of packets that can still be queued for the application
+// and set *p_capacity to the number that fit when nothing is queued
+static uint32_t rx_free_packets(midih_interface_t *p_midi_host, uint32_t *p_capacity)
+{
+  uint32_t free_packets = 0;
+  *p_capacity = midih_limits.midi_rx_buf / 4;
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  *p_capacity += CFG_MIDI_HOST_RX_RESERVE_SEGMENTS * (CFG_MIDI_HOST_RX_SEGMENT_BYTES / 4);
+  if (p_midi_host->rx_seg_q_wr != p_midi_host->rx_seg_q_rd)
+  {
+    // rx_ff cannot be used until the reader has emptied the segments
+    if (p_midi_host->rx_seg_cur != MIDIH_NO_SEGMENT)
+      free_packets += (uint32_t)(CFG_MIDI_HOST_RX_SEGMENT_BYTES - _midi_rx_reserve[p_midi_host->rx_seg_cur].wr) / 4;
+  }
+  else
+#endif
+  free_packets += tu_fifo_remaining(&p_midi_host->rx_ff) / 4;
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  free_packets += (uint32_t)midih_rx_seg_free * (CFG_MIDI_HOST_RX_SEGMENT_BYTES / 4);
+#endif
+  return free_packets;
+}
 
-      // assume it is an input jack
-      midi_desc_in_jack_t const *p_mdij = (midi_desc_in_jack_t const *)p_desc;
-      if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_HEADER)
-      {
-        TU_LOG2("Found MIDI Interface Header\r\b");
-      }
-      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_IN_JACK)
-      {
-        // Then it is an in jack. 
-        TU_LOG2("Found in jack\r\n");
-#if CFG_MIDI_HOST_DEVSTRINGS
-        if (p_midi_host->next_in_jack < MAX_IN_JACKS)
-        {
-          p_midi_host->in_jack_info[p_midi_host->next_in_jack].jack_id = p_mdij->bJackID;
-          p_midi_host->in_jack_info[p_midi_host->next_in_jack].jack_type = p_mdij->bJackType;
-          p_midi_host->in_jack_info[p_midi_host->next_in_jack].string_index = p_mdij->iJack;
-          ++p_midi_host->next_in_jack;
-          // Keep track of any string descriptor that might be here
-          if (p_mdij->iJack != 0)
-            p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = p_mdij->iJack;
+// Return true if a packet of class cls must be dropped to leave room for
+// packets of the classes that matter more
+static bool CFG_TUH_MIDI_HOT_FUNC(rx_shed)(midih_interface_t *p_midi_host, uint8_t cls)
+{
+  uint8_t const level = midih_rx_shed_level[cls];
+  if (level == 0)
+    return false;
+  uint32_t capacity;
+  uint32_t free_packets = rx_free_packets(p_midi_host, &capacity);
+  return free_packets * 16 < level * capacity;
+}
+#endif
 
-        }
+// Put the packet where the application reads it.
+// Return false if there was no room for it.
+static bool CFG_TUH_MIDI_HOT_FUNC(rx_deliver)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  bool queued;
+#if CFG_MIDI_HOST_RX_SHED
+  uint8_t const cls = rx_packet_class(buf);
+  if (rx_shed(p_midi_host, cls))
+  {
+    ++p_midi_host->rx_dropped[cls];
+    return false;
+  }
 #endif
-      }
-      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_OUT_JACK)
-      {
-        // then it is an out jack
-        TU_LOG2("Found out jack\r\n");
-#if CFG_MIDI_HOST_DEVSTRINGS
-        if (p_midi_host->next_out_jack < MAX_OUT_JACKS)
-        {
-          midi_desc_out_jack_t const *p_mdoj = (midi_desc_out_jack_t const *)p_desc;
-          p_midi_host->out_jack_info[p_midi_host->next_out_jack].jack_id = p_mdoj->bJackID;
-          p_midi_host->out_jack_info[p_midi_host->next_out_jack].jack_type = p_mdoj->bJackType;
-          p_midi_host->out_jack_info[p_midi_host->next_out_jack].num_source_ids = p_mdoj->bNrInputPins;
-          const struct associated_jack_s {
-              uint8_t id;
-              uint8_t pin;
-          } *associated_jack = (const struct associated_jack_s *)(p_desc+6);
-          int jack;
-          for (jack = 0; jack < p_mdoj->bNrInputPins; jack++)
-          {
-            p_midi_host->out_jack_info[p_midi_host->next_out_jack].source_ids[jack] = associated_jack->id;
-          }
-          p_midi_host->out_jack_info[p_midi_host->next_out_jack].string_index = *(p_desc+6+p_mdoj->bNrInputPins*2);
-          ++p_midi_host->next_out_jack;
-          if (p_mdoj->iJack != 0)
-            p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = p_mdoj->iJack;
-        }
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  // Once a packet goes to the reserve, the following packets must too
+  // until the reader has read all of them, or they would be read out of order.
+  if (p_midi_host->rx_seg_q_wr != p_midi_host->rx_seg_q_rd || tu_fifo_remaining(&p_midi_host->rx_ff) < 4)
+    queued = rx_reserve_write(p_midi_host, buf);
+  else
+#endif
+  queued = tu_fifo_write_n(&p_midi_host->rx_ff, buf, 4) == 4;
+#if CFG_MIDI_HOST_RX_SHED
+  if (!queued)
+    ++p_midi_host->rx_dropped[cls];
+#endif
+  TU_LOG3("MIDI RX=%02x%02x%02x%02x\r\n", buf[0], buf[1], buf[2], buf[3]);
+  return queued;
+}
+
+#if CFG_MIDI_HOST_RX_DEJITTER
+TU_VERIFY_STATIC((CFG_MIDI_HOST_RX_DEJITTER & (CFG_MIDI_HOST_RX_DEJITTER - 1)) == 0 && CFG_MIDI_HOST_RX_DEJITTER <= 32768,
+    "CFG_MIDI_HOST_RX_DEJITTER must be a power of 2 up to 32768");
+// Return true if the oldest packet was released to the application early
+// to make room, so the caller reports it through tuh_midi_rx_cb()
+static bool CFG_TUH_MIDI_HOT_FUNC(dejitter_push)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  bool released = false;
+  if ((uint16_t)(p_midi_host->rx_jit_wr - p_midi_host->rx_jit_rd) == CFG_MIDI_HOST_RX_DEJITTER)
+  {
+    // The buffer is full; release the oldest packet early rather than lose it
+    released = rx_deliver(p_midi_host, p_midi_host->rx_jit[p_midi_host->rx_jit_rd % CFG_MIDI_HOST_RX_DEJITTER].packet);
+    ++p_midi_host->rx_jit_rd;
+    ++p_midi_host->rx_jit_early;
+  }
+  uint16_t idx = p_midi_host->rx_jit_wr % CFG_MIDI_HOST_RX_DEJITTER;
+  p_midi_host->rx_jit[idx].release_us = CFG_TUH_MIDI_TIME_US() + p_midi_host->rx_jit_delay_us;
+  memcpy(p_midi_host->rx_jit[idx].packet, buf, 4);
+  ++p_midi_host->rx_jit_wr;
+  return released;
+}
+
+// Deliver the packets whose release time has come and
+// return the number of packets delivered
+static uint32_t dejitter_release(midih_interface_t *p_midi_host, uint32_t now)
+{
+  uint32_t released = 0;
+  while (p_midi_host->rx_jit_rd != p_midi_host->rx_jit_wr)
+  {
+    uint16_t idx = p_midi_host->rx_jit_rd % CFG_MIDI_HOST_RX_DEJITTER;
+    // After the delay is set to 0, release whatever is left right away
+    if (p_midi_host->rx_jit_delay_us != 0 && (int32_t)(now - p_midi_host->rx_jit[idx].release_us) < 0)
+      break;
+    if (rx_deliver(p_midi_host, p_midi_host->rx_jit[idx].packet))
+      ++released;
+    ++p_midi_host->rx_jit_rd;
+  }
+  return released;
+}
 #endif
+
+#if CFG_MIDI_HOST_RX_STATE
+static void rx_state_reset(midih_interface_t *p_midi_host)
+{
+  memset(p_midi_host->rx_state, 0xFF, sizeof(p_midi_host->rx_state));
+  for (int cable = 0; cable < CFG_MIDI_HOST_RX_STATE_CABLES; cable++)
+  {
+    for (int chan = 0; chan < 16; chan++)
+    {
+      tu_memclr(p_midi_host->rx_state[cable][chan].notes, sizeof(p_midi_host->rx_state[cable][chan].notes));
+    }
+  }
+}
+
+// Update the controller state with a received packet. Like
+// tuh_midi_stream_read(), this ignores the CIN field and goes by the status byte.
+static inline void rx_state_update(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  uint8_t const cable = buf[0] >> 4;
+  uint8_t const status = buf[1];
+  if (cable >= CFG_MIDI_HOST_RX_STATE_CABLES || status < 0x80 || status >= MIDI_STATUS_SYSEX_START)
+    return;
+  midih_rx_chan_state_t *state = &p_midi_host->rx_state[cable][status & 0xf];
+  uint8_t const data1 = buf[2] & MIDI_MAX_DATA_VAL;
+  uint8_t const data2 = buf[3] & MIDI_MAX_DATA_VAL;
+  uint8_t const bit = (uint8_t)(1u << (data1 % 8));
+  switch (status >> 4)
+  {
+    case MIDI_CIN_NOTE_ON:
+      if (data2 != 0)
+        state->notes[data1 / 8] |= bit;
+      else
+        state->notes[data1 / 8] &= (uint8_t)~bit; // velocity 0 is Note Off
+      break;
+    case MIDI_CIN_NOTE_OFF:
+      state->notes[data1 / 8] &= (uint8_t)~bit;
+      break;
+    case MIDI_CIN_POLY_KEYPRESS:
+      state->poly_pressure[data1] = data2;
+      break;
+    case MIDI_CIN_CONTROL_CHANGE:
+      state->cc[data1] = data2;
+      if (data1 == 121)
+      {
+        // Reset All Controllers; see MIDI RP-015
+        state->pitch_bend = 0x2000;
+        state->channel_pressure = 0;
+        tu_memclr(state->poly_pressure, sizeof(state->poly_pressure));
+        state->cc[1] = 0;
+        state->cc[11] = 127;
+        memset(&state->cc[64], 0, 4);
+        memset(&state->cc[98], 127, 4);
       }
-      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_ELEMENT)
+      else if (data1 == 120 || data1 >= 123)
       {
-        // the it is an element;
-    #if CFG_MIDI_HOST_DEVSTRINGS
-        TU_LOG1("Found element; strings not supported\r\n");
-    #else
-        TU_LOG2("Found element\r\n");
-    #endif
+        // All Sound Off, All Notes Off and the mode messages end all notes
+        tu_memclr(state->notes, sizeof(state->notes));
       }
-      else
+      break;
+    case MIDI_CIN_PROGRAM_CHANGE:
+      state->program = data1;
+      break;
+    case MIDI_CIN_CHANNEL_PRESSURE:
+      state->channel_pressure = data1;
+      break;
+    case MIDI_CIN_PITCH_BEND_CHANGE:
+      state->pitch_bend = (uint16_t)(data1 | (data2 << 7));
+      break;
+    default:
+      break;
+  }
+}
+#endif
+
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+// Keep track of the open SysEx message of each cable
+static inline void rx_sysex_track(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  uint8_t const cable = buf[0] >> 4;
+  uint16_t const cable_mask = (uint16_t)(1u << cable);
+  uint8_t const status = buf[1];
+  if (status >= MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+    return; // real time messages can come in the middle of a SysEx message
+  if (status == MIDI_STATUS_SYSEX_START)
+    p_midi_host->rx_sysex_open |= cable_mask;
+  else if (status > MIDI_MAX_DATA_VAL)
+    p_midi_host->rx_sysex_open &= (uint16_t)~cable_mask; // F7 or any other status byte ends it
+  if (buf[2] == MIDI_STATUS_SYSEX_END || buf[3] == MIDI_STATUS_SYSEX_END)
+    p_midi_host->rx_sysex_open &= (uint16_t)~cable_mask;
+  if (p_midi_host->rx_sysex_open & cable_mask)
+    p_midi_host->rx_sysex_us[cable] = CFG_TUH_MIDI_TIME_US();
+}
+#endif
+
+// Pass on a received packet no driver feature consumed
+static inline bool rx_accept(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+  rx_sysex_track(p_midi_host, buf);
+#endif
+#if CFG_MIDI_HOST_RX_STATE
+  rx_state_update(p_midi_host, buf);
+#endif
+#if CFG_MIDI_HOST_RX_TAP
+  if (midih_rx_tap.enabled)
+    rx_tap_write(p_midi_host, buf);
+#endif
+#if CFG_MIDI_HOST_CLOCK_REGEN
+  if (p_midi_host->dev_addr == midih_clock.dev_addr && (buf[0] >> 4) == midih_clock.cable)
+    clock_input(buf);
+#endif
+#if CFG_MIDI_HOST_RX_DEJITTER
+  // Keep using the buffer until it is empty so packets stay in order
+  if (p_midi_host->rx_jit_delay_us != 0 || p_midi_host->rx_jit_rd != p_midi_host->rx_jit_wr)
+  {
+    return dejitter_push(p_midi_host, buf);
+  }
+#endif
+  return rx_deliver(p_midi_host, buf);
+}
+
+// Return the number of packets queued for the application
+static inline uint32_t rx_queue_packet(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  uint32_t queued = 0;
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+  // Real time messages may come between the packets of a handshake reply
+  if (p_midi_host->hs_held && (buf[0] >> 4) == p_midi_host->hs_cable && buf[1] < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+  {
+    p_midi_host->hs_held = false;
+    if (hs_match_tail(p_midi_host, buf))
+      return 0;
+    // not a handshake reply; pass the held packet on first
+    queued += rx_accept(p_midi_host, p_midi_host->hs_head);
+  }
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+  if (p_midi_host->id_state >= MIDIH_ID_HEAD && (buf[0] >> 4) == p_midi_host->id_cable && buf[1] < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+  {
+    if (id_match_tail(p_midi_host, buf))
+      return queued;
+    // not an Identity Reply; pass the held packet on first
+    if (p_midi_host->id_state == MIDIH_ID_HEAD)
+      queued += rx_accept(p_midi_host, p_midi_host->id_head);
+    p_midi_host->id_state = MIDIH_ID_WAITING;
+  }
+#endif
+  if (rx_intercept(p_midi_host, buf))
+    return queued;
+  return queued + rx_accept(p_midi_host, buf);
+}
+
+// Copy the first byte of the oldest received packet to *p_byte.
+// Return false if there are no received packets.
+static inline bool rx_peek_byte(midih_interface_t *p_midi_host, uint8_t *p_byte)
+{
+  if (tu_fifo_peek(&p_midi_host->rx_ff, p_byte))
+    return true;
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  midih_rx_segment_t *seg = rx_reserve_front(p_midi_host);
+  if (seg != NULL)
+  {
+    *p_byte = seg->buf[seg->rd];
+    return true;
+  }
+#endif
+  return false;
+}
+
+// Read the oldest received packet. Packets in rx_ff are always older
+// than packets in the reserve. Return false if there are no received packets.
+static inline bool rx_read_packet(midih_interface_t *p_midi_host, uint8_t packet[4])
+{
+  if (tu_fifo_count(&p_midi_host->rx_ff) >= 4)
+    return tu_fifo_read_n(&p_midi_host->rx_ff, packet, 4) == 4;
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  midih_rx_segment_t *seg = rx_reserve_front(p_midi_host);
+  if (seg != NULL)
+  {
+    memcpy(packet, seg->buf + seg->rd, 4);
+    seg->rd += 4;
+    rx_reserve_front(p_midi_host); // give the segment back now if it is empty
+    return true;
+  }
+#endif
+  return false;
+}
+
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(rx_queue_single)(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets)
+{
+  uint32_t packets_queued = 0;
+  for (; npackets; npackets--, buf += 4)
+  {
+    if (!rx_packet_is_empty(buf))
+    {
+      buf[0] &= 0x0f; // there is only cable 0
+      packets_queued += rx_queue_packet(p_midi_host, buf);
+    }
+  }
+  return packets_queued;
+}
+
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(rx_queue_multi)(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets)
+{
+  uint32_t packets_queued = 0;
+  for (; npackets; npackets--, buf += 4)
+  {
+    if (!rx_packet_is_empty(buf))
+    {
+      if ((buf[0] >> 4) >= p_midi_host->num_cables_rx)
+        buf[0] &= 0x0f; // assume cable 0 if the cable number is invalid
+      packets_queued += rx_queue_packet(p_midi_host, buf);
+    }
+  }
+  return packets_queued;
+}
+
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(rx_queue_quirky)(midih_interface_t *p_midi_host, uint8_t *buf, uint32_t npackets)
+{
+  uint32_t packets_queued = 0;
+  for (; npackets; npackets--, buf += 4)
+  {
+    if (!rx_packet_is_empty(buf))
+    {
+      packets_queued += rx_queue_packet(p_midi_host, buf);
+    }
+  }
+  return packets_queued;
+}
+
+bool CFG_TUH_MIDI_HOT_FUNC(midih_xfer_cb)(uint8_t dev_addr, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+  (void)result;
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  if ( ep_addr == p_midi_host->ep_in)
+  {
+    // receive new data if available
+    uint32_t packets_queued = 0;
+    if (xferred_bytes)
+    {
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+      rx_reserve_collect();
+#endif
+      packets_queued = p_midi_host->ops->rx_queue(p_midi_host, p_midi_host->epin_buf, xferred_bytes / 4);
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+      rx_reserve_close(p_midi_host);
+#endif
+      // invoke receive callback if available
+      if (tuh_midi_rx_cb && packets_queued)
       {
-        TU_LOG2("Unknown CS Interface sub-type %u\r\n", p_mdij->bDescriptorSubType);
-        TU_VERIFY(false); // unknown CS Interface sub-type
+        tuh_midi_rx_cb(dev_addr, packets_queued);
       }
-      len_parsed += p_mdij->bLength;
     }
-    else if (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT)
+
+    TU_LOG2("Requesting poll IN endpoint %d\r\n", p_midi_host->ep_in);
+    TU_ASSERT(usbh_edpt_xfer(p_midi_host->dev_addr, p_midi_host->ep_in, p_midi_host->epin_buf, p_midi_host->ep_in_max), 0);
+  }
+  else if ( ep_addr == p_midi_host->ep_out )
+  {
+#if CFG_MIDI_HOST_STATE_CHASE
+    if (p_midi_host->replaying)
+      chase_replay_continue(p_midi_host);
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+    if (p_midi_host->hs_state == MIDIH_HS_SENDING)
+      hs_continue(p_midi_host);
+    else if (p_midi_host->hs_state == MIDIH_HS_ENDING)
+      hs_end(p_midi_host);
+#endif
+#if CFG_MIDI_HOST_ZLP
+    if (0 == write_flush(dev_addr, p_midi_host))
     {
-      TU_LOG2("found CS_ENDPOINT Descriptor for %02x\r\n", prev_ep_addr);
-      TU_VERIFY(prev_ep_addr != 0);
-      // parse out the mapping between the device's embedded jacks and the endpoints
-      // Each embedded IN jack is assocated with an OUT endpoint
-      midi_cs_desc_endpoint_t const* p_csep = (midi_cs_desc_endpoint_t const*)p_mdh;
-      if (tu_edpt_dir(prev_ep_addr) == TUSB_DIR_OUT)
+      // If there is no data left, a ZLP should be sent if
+      // xferred_bytes is multiple of EP size and not zero
+      if ( !tx_ff_count(p_midi_host) && xferred_bytes && (0 == (xferred_bytes % p_midi_host->ep_out_max)) )
       {
-        TU_VERIFY(p_midi_host->ep_out == prev_ep_addr);
-        TU_VERIFY(p_midi_host->num_cables_tx == 0);
-        p_midi_host->num_cables_tx = p_csep->bNumEmbMIDIJack;
-#if CFG_MIDI_HOST_DEVSTRINGS
-        uint8_t jack;
-        uint8_t max_jack = p_midi_host->num_cables_tx;
-        if (max_jack > sizeof(p_midi_host->ep_out_associated_jacks))
-        {
-            max_jack = sizeof(p_midi_host->ep_out_associated_jacks);
-        }
-        for (jack = 0; jack < max_jack; jack++)
+        if ( usbh_edpt_claim(dev_addr, p_midi_host->ep_out) )
         {
-          p_midi_host->ep_out_associated_jacks[jack] = p_csep->baAssocJackID[jack];
-        }
+          TU_ASSERT(usbh_edpt_xfer(dev_addr, p_midi_host->ep_out, XFER_RESULT_SUCCESS, 0));
+#if CFG_MIDI_HOST_TX_WATCHDOG
+          tx_watchdog_start(p_midi_host, 0);
 #endif
+        }
       }
-      else
-      {
-        TU_VERIFY(p_midi_host->ep_in == prev_ep_addr);
-        TU_VERIFY(p_midi_host->num_cables_rx == 0);
-        p_midi_host->num_cables_rx = p_csep->bNumEmbMIDIJack;
-#if CFG_MIDI_HOST_DEVSTRINGS
-        uint8_t jack;
-        uint8_t max_jack = p_midi_host->num_cables_rx;
-        if (max_jack > sizeof(p_midi_host->ep_in_associated_jacks))
-        {
+    }
+#else
+    write_flush(dev_addr, p_midi_host);
+#endif
+    if (tuh_midi_tx_cb)
+    {
+      tuh_midi_tx_cb(dev_addr);
+    }
+  }
+
+  return true;
+}
+
+void midih_close(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  if (p_midi_host == NULL)
+    return;
+  if (tuh_midi_umount_cb)
+    tuh_midi_umount_cb(dev_addr, 0);
+#if CFG_MIDI_HOST_DEVICE_KEY
+  key_table_remove(p_midi_host->device_key, dev_addr);
+  p_midi_host->device_key = 0;
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+  if (p_midi_host->chase)
+    p_midi_host->chase->attached = false;
+  p_midi_host->chase = NULL;
+  p_midi_host->replaying = false;
+#endif
+  tu_fifo_clear(&p_midi_host->rx_ff);
+#if CFG_MIDI_HOST_RX_STATE
+  rx_state_reset(p_midi_host);
+#endif
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  rx_reserve_collect();
+  for (int idx = 0; idx < CFG_MIDI_HOST_RX_RESERVE_SEGMENTS; idx++)
+  {
+    if (_midi_rx_reserve[idx].owner == dev_addr)
+    {
+      _midi_rx_reserve[idx].owner = 0;
+      ++midih_rx_seg_free;
+    }
+  }
+  p_midi_host->rx_seg_q_rd = p_midi_host->rx_seg_q_wr;
+  p_midi_host->rx_seg_cur = MIDIH_NO_SEGMENT;
+#endif
+  for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
+  {
+    tu_fifo_clear(&p_midi_host->tx_ff[producer]);
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    p_midi_host->tx_ts_wr[producer] = 0;
+    p_midi_host->tx_ts_rd[producer] = 0;
+#endif
+#if CFG_MIDI_HOST_TX_CANCEL
+    p_midi_host->tx_written[producer] = 0;
+    p_midi_host->tx_read[producer] = 0;
+    p_midi_host->tx_cancel_mark[producer] = 0;
+#endif
+  }
+  p_midi_host->tx_next_producer = 0;
+#if CFG_MIDI_HOST_TX_CANCEL
+  p_midi_host->tx_cancel_ack = p_midi_host->tx_cancel_seq;
+  p_midi_host->tx_cancel_mask = 0;
+  p_midi_host->tx_cancel_f7 = 0;
+  p_midi_host->tx_sysex_open = 0;
+#endif
+#if CFG_MIDI_HOST_TX_WATCHDOG
+  p_midi_host->tx_timeout_us = 0;
+  p_midi_host->tx_timeouts = 0;
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE
+  p_midi_host->tx_max_age_us = 0;
+  tu_memclr(p_midi_host->tx_cable_max_age_us, sizeof(p_midi_host->tx_cable_max_age_us));
+  p_midi_host->tx_expired = 0;
+#endif
+#if CFG_MIDI_HOST_TX_REALTIME
+  p_midi_host->tx_rt_rd = p_midi_host->tx_rt_wr;
+#endif
+#if CFG_MIDI_HOST_CLOCK_REGEN
+  clock_device_closed(dev_addr);
+#endif
+#if CFG_MIDI_HOST_RX_SHED
+  tu_memclr(p_midi_host->rx_dropped, sizeof(p_midi_host->rx_dropped));
+#endif
+#if CFG_MIDI_HOST_RX_DEJITTER
+  p_midi_host->rx_jit_rd = p_midi_host->rx_jit_wr;
+  p_midi_host->rx_jit_delay_us = 0;
+  p_midi_host->rx_jit_early = 0;
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+  p_midi_host->hs_held = false;
+  if (p_midi_host->hs_state != MIDIH_HS_IDLE)
+    hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_ABORTED);
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+  p_midi_host->id_state = MIDIH_ID_IDLE;
+  p_midi_host->id_valid = false;
+#endif
+#if CFG_MIDI_HOST_LATENCY_PROBE
+  p_midi_host->probe_pending = false;
+  p_midi_host->probe_sysex_head = false;
+  p_midi_host->probe_note_off = false;
+  tu_memclr(&p_midi_host->latency, sizeof(p_midi_host->latency));
+#endif
+#if CFG_MIDI_HOST_TX_SCHEDULE
+  p_midi_host->tx_sched_head = 0;
+  p_midi_host->tx_sched_count = 0;
+  p_midi_host->tx_offset_us = 0;
+  tu_memclr(p_midi_host->tx_cable_offset_us, sizeof(p_midi_host->tx_cable_offset_us));
+#endif
+  p_midi_host->ep_in = 0;
+  p_midi_host->ep_in_max = 0;
+  p_midi_host->ep_out = 0;
+  p_midi_host->ep_out_max = 0;
+  p_midi_host->itf_num = 0;
+  p_midi_host->num_cables_rx = 0;
+  p_midi_host->num_cables_tx = 0;
+  p_midi_host->dev_addr = 255; // invalid
+  p_midi_host->configured = false;
+  p_midi_host->ops = &midih_ops_multi;
+#if CFG_MIDI_HOST_STREAM_READ
+  p_midi_host->rx_sysex_in_progress = 0;
+  tu_memclr(&p_midi_host->stream_read, sizeof(p_midi_host->stream_read));
+#endif
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM && CFG_MIDI_HOST_STREAM_READ
+  tu_memclr(p_midi_host->rx_checksum, sizeof(p_midi_host->rx_checksum));
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+  p_midi_host->rx_sysex_open = 0;
+#endif
+#if CFG_MIDI_HOST_STREAM_WRITE
+  tu_memclr(p_midi_host->stream_write, sizeof(*(p_midi_host->stream_write))*midih_limits.max_cables*CFG_TUH_MIDI_TX_PRODUCERS);
+#endif
+}
+
+//--------------------------------------------------------------------+
+// Enumeration
+//--------------------------------------------------------------------+
+bool midih_open(uint8_t rhport, uint8_t dev_addr, tusb_desc_interface_t const *desc_itf, uint16_t max_len)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+
+  TU_VERIFY(p_midi_host != NULL);
+  p_midi_host->rhport = rhport;
+#if CFG_MIDI_HOST_DEVSTRINGS
+  p_midi_host->num_string_indices = 0;
+#endif
+  TU_VERIFY(TUSB_CLASS_AUDIO == desc_itf->bInterfaceClass);
+  // There can be just a MIDI interface or an audio and a MIDI interface. Only open the MIDI interface
+  uint8_t const *p_desc = (uint8_t const *) desc_itf;
+  uint16_t len_parsed = 0;
+  if (AUDIO_SUBCLASS_CONTROL == desc_itf->bInterfaceSubClass)
+  {
+#if CFG_MIDI_HOST_DEVSTRINGS
+    // Keep track of any string descriptor that might be here
+    if (desc_itf->iInterface != 0)
+        p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = desc_itf->iInterface;
+#endif
+    // This driver does not support audio streaming. However, if this is the audio control interface
+    // there might be a MIDI interface following it. Search through every descriptor until a MIDI
+    // interface is found or the end of the descriptor is found
+    while (len_parsed < max_len && (desc_itf->bInterfaceClass != TUSB_CLASS_AUDIO || desc_itf->bInterfaceSubClass != AUDIO_SUBCLASS_MIDI_STREAMING))
+    {
+      len_parsed += desc_itf->bLength;
+      p_desc = tu_desc_next(p_desc);
+      desc_itf = (tusb_desc_interface_t const *)p_desc;
+    }
+
+    TU_VERIFY(TUSB_CLASS_AUDIO == desc_itf->bInterfaceClass);
+  }
+  TU_VERIFY(AUDIO_SUBCLASS_MIDI_STREAMING == desc_itf->bInterfaceSubClass);
+  len_parsed += desc_itf->bLength;
+
+#if CFG_MIDI_HOST_DEVSTRINGS
+  // Keep track of any string descriptor that might be here
+  if (desc_itf->iInterface != 0)
+      p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = desc_itf->iInterface;
+#endif
+  p_desc = tu_desc_next(p_desc);
+  TU_LOG1("MIDI opening Interface %u (addr = %u)\r\n", desc_itf->bInterfaceNumber, dev_addr);
+  // Find out if getting the MIDI class specific interface header or an endpoint descriptor
+  // or a class-specific endpoint descriptor
+  // Jack descriptors or element descriptors must follow the cs interface header,
+  // but this driver does not support devices that contain element descriptors
+
+  // assume it is an interface header
+  midi_desc_header_t const *p_mdh = (midi_desc_header_t const *)p_desc;
+  TU_VERIFY((p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE && p_mdh->bDescriptorSubType == MIDI_CS_INTERFACE_HEADER) || 
+    (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT && p_mdh->bDescriptorSubType == MIDI_CS_ENDPOINT_GENERAL) ||
+    p_mdh->bDescriptorType == TUSB_DESC_ENDPOINT);
+
+  uint8_t prev_ep_addr = 0; // the CS endpoint descriptor is associated with the previous endpoint descrptor
+  p_midi_host->itf_num = desc_itf->bInterfaceNumber;
+  tusb_desc_endpoint_t const* in_desc = NULL;
+  tusb_desc_endpoint_t const* out_desc = NULL;
+  while (len_parsed < max_len)
+  {
+    TU_VERIFY((p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE) || 
+      (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT && p_mdh->bDescriptorSubType == MIDI_CS_ENDPOINT_GENERAL) ||
+      p_mdh->bDescriptorType == TUSB_DESC_ENDPOINT);
+
+    if (p_mdh->bDescriptorType == TUSB_DESC_CS_INTERFACE) {
+      // The USB host doesn't really need this information unless it uses
+      // the string descriptor for a jack or Element
+
+      // assume it is an input jack
+      midi_desc_in_jack_t const *p_mdij = (midi_desc_in_jack_t const *)p_desc;
+      if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_HEADER)
+      {
+        TU_LOG2("Found MIDI Interface Header\r\b");
+      }
+      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_IN_JACK)
+      {
+        // Then it is an in jack. 
+        TU_LOG2("Found in jack\r\n");
+#if CFG_MIDI_HOST_DEVSTRINGS
+        if (p_midi_host->next_in_jack < MAX_IN_JACKS)
+        {
+          p_midi_host->in_jack_info[p_midi_host->next_in_jack].jack_id = p_mdij->bJackID;
+          p_midi_host->in_jack_info[p_midi_host->next_in_jack].jack_type = p_mdij->bJackType;
+          p_midi_host->in_jack_info[p_midi_host->next_in_jack].string_index = p_mdij->iJack;
+          ++p_midi_host->next_in_jack;
+          // Keep track of any string descriptor that might be here
+          if (p_mdij->iJack != 0)
+            p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = p_mdij->iJack;
+
+        }
+#endif
+      }
+      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_OUT_JACK)
+      {
+        // then it is an out jack
+        TU_LOG2("Found out jack\r\n");
+#if CFG_MIDI_HOST_DEVSTRINGS
+        if (p_midi_host->next_out_jack < MAX_OUT_JACKS)
+        {
+          midi_desc_out_jack_t const *p_mdoj = (midi_desc_out_jack_t const *)p_desc;
+          p_midi_host->out_jack_info[p_midi_host->next_out_jack].jack_id = p_mdoj->bJackID;
+          p_midi_host->out_jack_info[p_midi_host->next_out_jack].jack_type = p_mdoj->bJackType;
+          p_midi_host->out_jack_info[p_midi_host->next_out_jack].num_source_ids = p_mdoj->bNrInputPins;
+          const struct associated_jack_s {
+              uint8_t id;
+              uint8_t pin;
+          } *associated_jack = (const struct associated_jack_s *)(p_desc+6);
+          int jack;
+          for (jack = 0; jack < p_mdoj->bNrInputPins; jack++)
+          {
+            p_midi_host->out_jack_info[p_midi_host->next_out_jack].source_ids[jack] = associated_jack->id;
+          }
+          p_midi_host->out_jack_info[p_midi_host->next_out_jack].string_index = *(p_desc+6+p_mdoj->bNrInputPins*2);
+          ++p_midi_host->next_out_jack;
+          if (p_mdoj->iJack != 0)
+            p_midi_host->all_string_indices[p_midi_host->num_string_indices++] = p_mdoj->iJack;
+        }
+#endif
+      }
+      else if (p_mdij->bDescriptorSubType == MIDI_CS_INTERFACE_ELEMENT)
+      {
+        // the it is an element;
+    #if CFG_MIDI_HOST_DEVSTRINGS
+        TU_LOG1("Found element; strings not supported\r\n");
+    #else
+        TU_LOG2("Found element\r\n");
+    #endif
+      }
+      else
+      {
+        TU_LOG2("Unknown CS Interface sub-type %u\r\n", p_mdij->bDescriptorSubType);
+        TU_VERIFY(false); // unknown CS Interface sub-type
+      }
+      len_parsed += p_mdij->bLength;
+    }
+    else if (p_mdh->bDescriptorType == TUSB_DESC_CS_ENDPOINT)
+    {
+      TU_LOG2("found CS_ENDPOINT Descriptor for %02x\r\n", prev_ep_addr);
+      TU_VERIFY(prev_ep_addr != 0);
+      // parse out the mapping between the device's embedded jacks and the endpoints
+      // Each embedded IN jack is assocated with an OUT endpoint
+      midi_cs_desc_endpoint_t const* p_csep = (midi_cs_desc_endpoint_t const*)p_mdh;
+      if (tu_edpt_dir(prev_ep_addr) == TUSB_DIR_OUT)
+      {
+        TU_VERIFY(p_midi_host->ep_out == prev_ep_addr);
+        TU_VERIFY(p_midi_host->num_cables_tx == 0);
+        p_midi_host->num_cables_tx = p_csep->bNumEmbMIDIJack;
+#if CFG_MIDI_HOST_DEVSTRINGS
+        uint8_t jack;
+        uint8_t max_jack = p_midi_host->num_cables_tx;
+        if (max_jack > sizeof(p_midi_host->ep_out_associated_jacks))
+        {
+            max_jack = sizeof(p_midi_host->ep_out_associated_jacks);
+        }
+        for (jack = 0; jack < max_jack; jack++)
+        {
+          p_midi_host->ep_out_associated_jacks[jack] = p_csep->baAssocJackID[jack];
+        }
+#endif
+      }
+      else
+      {
+        TU_VERIFY(p_midi_host->ep_in == prev_ep_addr);
+        TU_VERIFY(p_midi_host->num_cables_rx == 0);
+        p_midi_host->num_cables_rx = p_csep->bNumEmbMIDIJack;
+#if CFG_MIDI_HOST_DEVSTRINGS
+        uint8_t jack;
+        uint8_t max_jack = p_midi_host->num_cables_rx;
+        if (max_jack > sizeof(p_midi_host->ep_in_associated_jacks))
+        {
             max_jack = sizeof(p_midi_host->ep_in_associated_jacks);
         }
         for (jack = 0; jack < max_jack; jack++)
@@ -512,267 +1746,2100 @@ bool midih_open(uint8_t rhport, uint8_t dev_addr, tusb_desc_interface_t const *d
     p_desc = tu_desc_next(p_desc);
     p_mdh = (midi_desc_header_t const *)p_desc;
   }
-  TU_VERIFY((p_midi_host->ep_out != 0 && p_midi_host->num_cables_tx != 0) ||
-            (p_midi_host->ep_in != 0 && p_midi_host->num_cables_rx != 0));
-  TU_LOG1("MIDI descriptor parsed successfully\r\n");
-#if CFG_MIDI_HOST_DEVSTRINGS
-  // remove duplicate string indices
-  for (int idx=0; idx < p_midi_host->num_string_indices; idx++) {
-      for (int jdx = idx+1; jdx < p_midi_host->num_string_indices; jdx++) {
-          while (jdx < p_midi_host->num_string_indices &&  p_midi_host->all_string_indices[idx] == p_midi_host->all_string_indices[jdx]) {
-              // delete the duplicate by overwriting it with the last entry and reducing the number of entries by 1
-              p_midi_host->all_string_indices[jdx] = p_midi_host->all_string_indices[p_midi_host->num_string_indices-1];
-              --p_midi_host->num_string_indices;
-          }
-      }
+  TU_VERIFY((p_midi_host->ep_out != 0 && p_midi_host->num_cables_tx != 0) ||
+            (p_midi_host->ep_in != 0 && p_midi_host->num_cables_rx != 0));
+  TU_LOG1("MIDI descriptor parsed successfully\r\n");
+#if CFG_MIDI_HOST_DEVSTRINGS
+  // remove duplicate string indices
+  for (int idx=0; idx < p_midi_host->num_string_indices; idx++) {
+      for (int jdx = idx+1; jdx < p_midi_host->num_string_indices; jdx++) {
+          while (jdx < p_midi_host->num_string_indices &&  p_midi_host->all_string_indices[idx] == p_midi_host->all_string_indices[jdx]) {
+              // delete the duplicate by overwriting it with the last entry and reducing the number of entries by 1
+              p_midi_host->all_string_indices[jdx] = p_midi_host->all_string_indices[p_midi_host->num_string_indices-1];
+              --p_midi_host->num_string_indices;
+          }
+      }
+  }
+#endif
+  if (in_desc)
+  {
+    TU_ASSERT(tuh_edpt_open(dev_addr, in_desc));
+    // Some devices always return exactly the request length so transfers won't complete
+    // unless you assume every transfer is the last one.
+    // TODO usbh_edpt_force_last_buffer(dev_addr, p_midi_host->ep_in, true);
+  }
+  if (out_desc)
+  {
+    TU_ASSERT(tuh_edpt_open(dev_addr, out_desc));
+  }
+  p_midi_host->dev_addr = dev_addr;
+  if (p_midi_host->ep_in != 0 && (p_midi_host->num_cables_rx == 0 || p_midi_host->num_cables_rx > 16))
+  {
+    TU_LOG1("MIDI IN endpoint has %u cables; cable numbers will not be checked\r\n", p_midi_host->num_cables_rx);
+    p_midi_host->ops = &midih_ops_quirky;
+  }
+  else if (p_midi_host->num_cables_rx == 1)
+  {
+    p_midi_host->ops = &midih_ops_single;
+  }
+  else
+  {
+    p_midi_host->ops = &midih_ops_multi;
+  }
+
+  return true;
+}
+
+bool tuh_midi_configured(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  return p_midi_host->configured;
+}
+
+#if CFG_MIDI_HOST_DEVICE_KEY
+//--------------------------------------------------------------------+
+// Device key
+//--------------------------------------------------------------------+
+static uint32_t fnv1a_hash(uint32_t hash, uint8_t const* data, size_t len)
+{
+  while (len--)
+  {
+    hash ^= *data++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t compute_device_key(uint8_t dev_addr, midih_interface_t *p_midi_host)
+{
+  uint32_t hash = 2166136261u;
+  uint16_t vid = 0, pid = 0;
+  tuh_vid_pid_get(dev_addr, &vid, &pid);
+  uint8_t const ids[4] = {(uint8_t)vid, (uint8_t)(vid >> 8), (uint8_t)pid, (uint8_t)(pid >> 8)};
+  hash = fnv1a_hash(hash, ids, sizeof(ids));
+
+  // hash the UTF-16 characters of the serial string descriptor, if any
+  uint8_t const* serial = (uint8_t const*)p_midi_host->serial_desc;
+  size_t serial_len = serial[0];
+  if (serial_len > sizeof(p_midi_host->serial_desc))
+    serial_len = sizeof(p_midi_host->serial_desc);
+  if (serial_len > 2)
+    hash = fnv1a_hash(hash, serial + 2, serial_len - 2);
+
+  // hash the hub port path, walking from the device up to the root port
+  hcd_devtree_info_t devtree;
+  uint8_t addr = dev_addr;
+  do
+  {
+    hcd_devtree_get_info(addr, &devtree);
+    hash = fnv1a_hash(hash, &devtree.hub_port, 1);
+    addr = devtree.hub_addr;
+  } while (addr != 0);
+  hash = fnv1a_hash(hash, &devtree.rhport, 1);
+
+  return hash ? hash : 1; // 0 means no key
+}
+
+static void key_table_insert(uint32_t device_key, uint8_t dev_addr)
+{
+  uint32_t idx = device_key & (MIDIH_KEY_TABLE_SIZE-1);
+  while (midih_key_table[idx].device_key != 0 && midih_key_table[idx].device_key != device_key)
+  {
+    idx = (idx + 1) & (MIDIH_KEY_TABLE_SIZE-1);
+  }
+  midih_key_table[idx].device_key = device_key;
+  midih_key_table[idx].dev_addr = dev_addr;
+}
+
+static void key_table_remove(uint32_t device_key, uint8_t dev_addr)
+{
+  if (device_key == 0)
+    return;
+  uint32_t idx = device_key & (MIDIH_KEY_TABLE_SIZE-1);
+  while (midih_key_table[idx].device_key != device_key)
+  {
+    if (midih_key_table[idx].device_key == 0)
+      return; // not in the table
+    idx = (idx + 1) & (MIDIH_KEY_TABLE_SIZE-1);
+  }
+  if (midih_key_table[idx].dev_addr != dev_addr)
+    return; // the key belongs to a more recently mounted device
+  // Delete the entry and move back any entries in the same probe
+  // sequence that could no longer be found after the gap
+  uint32_t gap = idx;
+  for (;;)
+  {
+    midih_key_table[gap].device_key = 0;
+    uint32_t next = gap;
+    for (;;)
+    {
+      next = (next + 1) & (MIDIH_KEY_TABLE_SIZE-1);
+      if (midih_key_table[next].device_key == 0)
+        return;
+      uint32_t home = midih_key_table[next].device_key & (MIDIH_KEY_TABLE_SIZE-1);
+      // move the entry if its home slot is not cyclically in (gap, next]
+      if (((next - home) & (MIDIH_KEY_TABLE_SIZE-1)) >= ((next - gap) & (MIDIH_KEY_TABLE_SIZE-1)))
+        break;
+    }
+    midih_key_table[gap] = midih_key_table[next];
+    gap = next;
+  }
+}
+
+static void serial_string_complete(tuh_xfer_t* xfer)
+{
+  midih_interface_t *p_midi_host = get_midi_host(xfer->daddr);
+  if (p_midi_host == NULL)
+    return;
+  if (xfer->result != XFER_RESULT_SUCCESS)
+  {
+    // use VID, PID and port path only
+    tu_memclr(p_midi_host->serial_desc, sizeof(p_midi_host->serial_desc));
+  }
+  config_complete(xfer->daddr, (uint8_t)xfer->user_data);
+}
+
+uint32_t tuh_midi_get_device_key(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, 0);
+  return p_midi_host->device_key;
+}
+
+uint8_t tuh_midi_find_device(uint32_t device_key)
+{
+  TU_VERIFY(device_key != 0, 0);
+  uint32_t idx = device_key & (MIDIH_KEY_TABLE_SIZE-1);
+  while (midih_key_table[idx].device_key != 0)
+  {
+    if (midih_key_table[idx].device_key == device_key)
+      return midih_key_table[idx].dev_addr;
+    idx = (idx + 1) & (MIDIH_KEY_TABLE_SIZE-1);
+  }
+  return 0;
+}
+#endif
+
+#if CFG_MIDI_HOST_STATE_CHASE
+//--------------------------------------------------------------------+
+// State chase
+//--------------------------------------------------------------------+
+static void chase_record_init(midih_chase_record_t *rec, uint32_t device_key)
+{
+  tu_memclr(rec, sizeof(*rec));
+  rec->device_key = device_key;
+  midih_chan_state_t *chan = &rec->chan[0][0];
+  for (int idx = 0; idx < CFG_MIDI_HOST_STATE_CHASE_CABLES*16; idx++)
+  {
+    chan[idx].pitch_bend = 0xFFFF;
+    chan[idx].program = 0xFF;
+  }
+}
+
+// Find the record for the device's key or take the record of the
+// device that was attached least recently. Return true if the record
+// was found, which means there may be state to replay
+static bool chase_attach(midih_interface_t *p_midi_host)
+{
+  midih_chase_record_t *found = NULL;
+  midih_chase_record_t *oldest = NULL;
+  for (int idx = 0; idx < CFG_TUH_DEVICE_MAX && found == NULL; idx++)
+  {
+    midih_chase_record_t *rec = &_midi_chase[idx];
+    if (rec->device_key == p_midi_host->device_key)
+      found = rec;
+    else if (!rec->attached && (oldest == NULL || rec->attach_count < oldest->attach_count))
+      oldest = rec;
+  }
+  bool known = (found != NULL);
+  if (!known)
+  {
+    // there is always an unattached record because there is one per device
+    found = oldest;
+    chase_record_init(found, p_midi_host->device_key);
+  }
+  found->attached = true;
+  found->attach_count = ++midih_chase_attach_count;
+  p_midi_host->chase = found;
+  return known;
+}
+
+static void CFG_TUH_MIDI_HOT_FUNC(chase_capture)(midih_interface_t *p_midi_host, uint8_t const packet[4])
+{
+  uint8_t const cable = packet[0] >> 4;
+  if (p_midi_host->chase == NULL || cable >= CFG_MIDI_HOST_STATE_CHASE_CABLES)
+    return;
+  // ignore the CIN field, like the rest of the driver does
+  midih_chan_state_t *chan = &p_midi_host->chase->chan[cable][packet[1] & 0xf];
+  switch (packet[1] >> 4)
+  {
+    case MIDI_CIN_CONTROL_CHANGE:
+      chan->cc[packet[2] & 0x7f] = packet[3];
+      chan->cc_valid[(packet[2] & 0x7f) >> 3] |= (uint8_t)(1 << (packet[2] & 7));
+      break;
+    case MIDI_CIN_PROGRAM_CHANGE:
+      chan->program = packet[2];
+      break;
+    case MIDI_CIN_PITCH_BEND_CHANGE:
+      chan->pitch_bend = (uint16_t)(packet[2] | (packet[3] << 7));
+      break;
+    default:
+      break;
+  }
+}
+
+// Return true if the controller is state that replaying can restore
+static bool chase_cc_replayable(uint8_t cc)
+{
+  return !(cc == 0 || cc == 32 ||                // Bank Select is sent before Program Change
+           cc == 6 || cc == 38 ||                // Data Entry
+           (cc >= 96 && cc <= 101) ||            // Data Increment/Decrement, NRPN, RPN
+           cc >= 120);                           // Channel Mode messages
+}
+
+// Get the next packet to replay. Items per channel are Bank Select MSB,
+// Bank Select LSB, Program Change, Control Changes 1-119, Pitch Bend.
+// Return false when there are no more packets.
+static bool chase_next_packet(midih_interface_t *p_midi_host, uint8_t packet[4])
+{
+  enum {ITEM_PROGRAM = 2, ITEM_FIRST_CC = 3, ITEM_PITCH_BEND = ITEM_FIRST_CC + 128};
+  while (p_midi_host->replay_cable < CFG_MIDI_HOST_STATE_CHASE_CABLES &&
+         p_midi_host->replay_cable < p_midi_host->num_cables_tx)
+  {
+    midih_chan_state_t const *chan = &p_midi_host->chase->chan[p_midi_host->replay_cable][p_midi_host->replay_chan];
+    uint8_t const cin = MIDI_CIN_CONTROL_CHANGE;
+    packet[0] = (uint8_t)((p_midi_host->replay_cable << 4) | cin);
+    packet[1] = (uint8_t)((cin << 4) | p_midi_host->replay_chan);
+    bool found = false;
+    while (!found && p_midi_host->replay_item <= ITEM_PITCH_BEND)
+    {
+      uint8_t const item = p_midi_host->replay_item++;
+      uint8_t cc = 0;
+      if (item < ITEM_PROGRAM)
+      {
+        cc = (item == 0) ? 0 : 32;
+      }
+      else if (item == ITEM_PROGRAM)
+      {
+        if (chan->program != 0xFF)
+        {
+          packet[0] = (uint8_t)((packet[0] & 0xf0) | MIDI_CIN_PROGRAM_CHANGE);
+          packet[1] = (uint8_t)((MIDI_CIN_PROGRAM_CHANGE << 4) | p_midi_host->replay_chan);
+          packet[2] = chan->program;
+          packet[3] = 0;
+          found = true;
+        }
+        continue;
+      }
+      else if (item == ITEM_PITCH_BEND)
+      {
+        if (chan->pitch_bend != 0xFFFF)
+        {
+          packet[0] = (uint8_t)((packet[0] & 0xf0) | MIDI_CIN_PITCH_BEND_CHANGE);
+          packet[1] = (uint8_t)((MIDI_CIN_PITCH_BEND_CHANGE << 4) | p_midi_host->replay_chan);
+          packet[2] = chan->pitch_bend & 0x7f;
+          packet[3] = (uint8_t)(chan->pitch_bend >> 7);
+          found = true;
+        }
+        continue;
+      }
+      else
+      {
+        cc = item - ITEM_FIRST_CC;
+        if (!chase_cc_replayable(cc))
+          continue;
+      }
+      if (chan->cc_valid[cc >> 3] & (1 << (cc & 7)))
+      {
+        packet[2] = cc;
+        packet[3] = chan->cc[cc];
+        found = true;
+      }
+    }
+    if (found)
+      return true;
+    p_midi_host->replay_item = 0;
+    if (++p_midi_host->replay_chan == 16)
+    {
+      p_midi_host->replay_chan = 0;
+      ++p_midi_host->replay_cable;
+    }
+  }
+  return false;
+}
+
+// Top up the OUT FIFO with replay packets
+static void chase_replay_continue(midih_interface_t *p_midi_host)
+{
+  uint8_t packet[4];
+  tu_fifo_t *tx_ff = get_tx_ff(p_midi_host);
+  while (tu_fifo_remaining(tx_ff) >= 4)
+  {
+    if (!chase_next_packet(p_midi_host, packet))
+    {
+      p_midi_host->replaying = false;
+      return;
+    }
+    tx_ff_write(p_midi_host, tx_ff, packet);
+  }
+}
+
+bool tuh_midi_state_replay(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  TU_VERIFY(p_midi_host->chase != NULL && !p_midi_host->replaying && p_midi_host->ep_out != 0);
+  p_midi_host->replay_cable = 0;
+  p_midi_host->replay_chan = 0;
+  p_midi_host->replay_item = 0;
+  p_midi_host->replaying = true;
+  uint32_t queued = tx_ff_count(p_midi_host);
+  chase_replay_continue(p_midi_host);
+  if (tx_ff_count(p_midi_host) == queued)
+  {
+    // nothing was written to the device
+    p_midi_host->replaying = false;
+    return false;
+  }
+  if (!usbh_edpt_busy(dev_addr, p_midi_host->ep_out))
+    write_flush(dev_addr, p_midi_host);
+  return true;
+}
+
+void tuh_midi_state_clear(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  if (p_midi_host == NULL || p_midi_host->chase == NULL)
+    return;
+  p_midi_host->replaying = false;
+  chase_record_init(p_midi_host->chase, p_midi_host->device_key);
+  p_midi_host->chase->attached = true;
+  p_midi_host->chase->attach_count = ++midih_chase_attach_count;
+}
+#endif
+
+bool midih_set_config(uint8_t dev_addr, uint8_t itf_num)
+{
+  TU_LOG2("Set config dev_addr=%u\r\n", dev_addr);
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+#if CFG_MIDI_HOST_DEVICE_KEY
+  tu_memclr(p_midi_host->serial_desc, sizeof(p_midi_host->serial_desc));
+  tusb_desc_device_t desc_device;
+  if (tuh_descriptor_get_device_local(dev_addr, &desc_device) && desc_device.iSerialNumber != 0)
+  {
+    // Finish configuration after the serial number string is read
+    if (tuh_descriptor_get_serial_string(dev_addr, 0x0409, p_midi_host->serial_desc, sizeof(p_midi_host->serial_desc),
+                                         serial_string_complete, itf_num))
+      return true;
+  }
+#endif
+  config_complete(dev_addr, itf_num);
+  return true;
+}
+
+static void config_complete(uint8_t dev_addr, uint8_t itf_num)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  p_midi_host->configured = true;
+#if CFG_MIDI_HOST_DEVICE_KEY
+  p_midi_host->device_key = compute_device_key(dev_addr, p_midi_host);
+  key_table_insert(p_midi_host->device_key, dev_addr);
+#endif
+#if CFG_MIDI_HOST_TX_WATCHDOG
+  p_midi_host->tx_timeout_us = CFG_TUH_MIDI_TX_TIMEOUT_US;
+  p_midi_host->tx_retries = CFG_TUH_MIDI_TX_RETRIES;
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+  if (chase_attach(p_midi_host) && CFG_MIDI_HOST_STATE_CHASE_AUTO)
+    tuh_midi_state_replay(dev_addr);
+#endif
+
+  TU_LOG2("Requesting poll IN endpoint %d\r\n", p_midi_host->ep_in);
+  TU_ASSERT(usbh_edpt_xfer(p_midi_host->dev_addr, p_midi_host->ep_in, p_midi_host->epin_buf, p_midi_host->ep_in_max), );
+#if CFG_MIDI_HOST_IDENTITY
+  if (p_midi_host->ep_out != 0 && p_midi_host->num_cables_tx != 0)
+  {
+    p_midi_host->id_state = MIDIH_ID_WAITING;
+    p_midi_host->id_next_cable = 0;
+    p_midi_host->id_replies = 0;
+    id_send(p_midi_host);
+  }
+#endif
+  if (tuh_midi_mount_cb)
+  {
+    tuh_midi_mount_cb(dev_addr, p_midi_host->ep_in, p_midi_host->ep_out, p_midi_host->num_cables_rx, p_midi_host->num_cables_tx);
+  }
+  usbh_driver_set_config_complete(dev_addr, itf_num);
+}
+
+//--------------------------------------------------------------------+
+// Stream API
+//--------------------------------------------------------------------+
+#if CFG_MIDI_HOST_TX_WATCHDOG
+// Note when an OUT transfer of len bytes started
+static inline void tx_watchdog_start(midih_interface_t *midi, uint16_t len)
+{
+  midi->tx_xfer_us = CFG_TUH_MIDI_TIME_US();
+  midi->tx_xfer_len = len;
+  midi->tx_retry_count = 0;
+}
+#endif
+
+#if CFG_MIDI_HOST_TX_MAX_AGE
+// Return true if the packet can be dropped when it is too old. Note Off,
+// Note On with velocity 0, switch pedals (controllers 64 to 69) going off,
+// Channel Mode messages, SysEx and system messages are always sent, so
+// nothing is left hanging.
+static inline bool tx_packet_ages(uint8_t const *packet)
+{
+  switch (packet[0] & 0xf)
+  {
+    case MIDI_CIN_NOTE_ON:
+      return packet[3] != 0;
+    case MIDI_CIN_CONTROL_CHANGE:
+      if (packet[2] >= 64 && packet[2] <= 69)
+        return packet[3] >= 64;
+      return packet[2] < 120;
+    case MIDI_CIN_POLY_KEYPRESS:
+    case MIDI_CIN_PROGRAM_CHANGE:
+    case MIDI_CIN_CHANNEL_PRESSURE:
+    case MIDI_CIN_PITCH_BEND_CHANGE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+#endif
+
+#if CFG_MIDI_HOST_TX_CANCEL
+// Note whether the cable of a packet sent to the device is in a SysEx
+static inline void tx_track_sysex(midih_interface_t *midi, uint8_t const *packet)
+{
+  uint16_t const cable_bit = (uint16_t)(1u << (packet[0] >> 4));
+  uint8_t const cin = packet[0] & 0xf;
+  if (cin == MIDI_CIN_SYSEX_START)
+    midi->tx_sysex_open |= cable_bit;
+  else if (cin == MIDI_CIN_1BYTE_DATA &&
+           (packet[1] <= MIDI_MAX_DATA_VAL || packet[1] >= MIDI_STATUS_SYSREAL_TIMING_CLOCK))
+    return; // SysEx data bytes and real time messages do not end a SysEx
+  else if (cin >= MIDI_CIN_SYSCOM_2BYTE) // CIN 0 and 1 are reserved
+    midi->tx_sysex_open &= (uint16_t)~cable_bit;
+}
+
+// Put a SysEx end packet for cable in packet
+static inline void tx_sysex_end(uint8_t *packet, uint8_t cable)
+{
+  packet[0] = (uint8_t)((cable << 4) | MIDI_CIN_SYSEX_END_1BYTE);
+  packet[1] = MIDI_STATUS_SYSEX_END;
+  packet[2] = 0;
+  packet[3] = 0;
+}
+
+// Take the latest request from tuh_midi_tx_cancel()
+static inline void tx_cancel_take(midih_interface_t *midi)
+{
+  uint8_t const seq = midi->tx_cancel_seq;
+  if (seq == midi->tx_cancel_ack)
+    return;
+  for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
+  {
+    midi->tx_cancel_mark[producer] = midi->tx_cancel_req_mark[producer];
+  }
+  midi->tx_cancel_mask |= midi->tx_cancel_req_mask;
+  midi->tx_cancel_f7 |= midi->tx_cancel_req_mask;
+  midi->tx_cancel_ack = seq;
+}
+
+// Once write_flush() has read every packet a cancel applies to, end the
+// SysEx messages the cancel cut short. Returns the number of bytes added to buf.
+static uint16_t tx_cancel_finish(midih_interface_t *midi, uint8_t *buf, uint16_t bufsize)
+{
+  if (midi->tx_cancel_mask == 0 && midi->tx_cancel_f7 == 0)
+    return 0;
+  for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
+  {
+    if ((int32_t)(midi->tx_read[producer] - midi->tx_cancel_mark[producer]) < 0)
+      return 0;
+  }
+  midi->tx_cancel_mask = 0;
+  uint16_t count = 0;
+  for (uint8_t cable = 0; cable < 16 && midi->tx_cancel_f7; cable++)
+  {
+    uint16_t const cable_bit = (uint16_t)(1u << cable);
+    if (!(midi->tx_cancel_f7 & cable_bit))
+      continue;
+    if (midi->tx_sysex_open & cable_bit)
+    {
+      if (count + 4 > bufsize)
+        break; // finish next time
+      tx_sysex_end(buf + count, cable);
+      count += 4;
+      midi->tx_sysex_open &= (uint16_t)~cable_bit;
+    }
+    midi->tx_cancel_f7 &= (uint16_t)~cable_bit;
+  }
+  return count;
+}
+#endif
+
+#if CFG_MIDI_HOST_TX_MAX_AGE || CFG_MIDI_HOST_TX_CANCEL
+// Read whole packets from the OUT FIFO of producer to buf one at a time
+// and drop the ones that are too old or cancelled. Returns the number of
+// bytes in buf.
+static uint16_t CFG_TUH_MIDI_HOT_FUNC(tx_read_filtered)(midih_interface_t *midi, uint8_t producer, uint8_t *buf, uint16_t bufsize)
+{
+  tu_fifo_t *tx_ff = &midi->tx_ff[producer];
+#if CFG_MIDI_HOST_TX_MAX_AGE
+  uint16_t const entries = (uint16_t)(midih_limits.midi_tx_buf / 4);
+  uint32_t const *ts = midi->tx_ts_buf + producer*entries;
+  uint32_t const now = CFG_TUH_MIDI_TIME_US();
+#endif
+  uint16_t count = 0;
+  while (count + 4 <= bufsize && tu_fifo_count(tx_ff) >= 4)
+  {
+    uint8_t *packet = buf + count;
+    tu_fifo_peek_n(tx_ff, packet, 4);
+#if CFG_MIDI_HOST_TX_CANCEL
+    uint8_t const cable = packet[0] >> 4;
+    uint16_t const cable_bit = (uint16_t)(1u << cable);
+    bool const cancelled = (midi->tx_cancel_mask & cable_bit) &&
+                           (int32_t)(midi->tx_read[producer] - midi->tx_cancel_mark[producer]) < 0;
+    if (!cancelled && (midi->tx_cancel_f7 & cable_bit))
+    {
+      // This is the first packet written to the cable after a cancel,
+      // so end the SysEx the cancel cut short before sending it
+      if (midi->tx_sysex_open & cable_bit)
+      {
+        if (count + 8 > bufsize)
+          break; // no room for both; send them next time
+        tx_sysex_end(packet, cable);
+        midi->tx_sysex_open &= (uint16_t)~cable_bit;
+        count += 4;
+        packet = buf + count;
+        tu_fifo_peek_n(tx_ff, packet, 4);
+      }
+      midi->tx_cancel_f7 &= (uint16_t)~cable_bit;
+    }
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    // Keep the timestamps in step with the FIFO, whatever happens to the
+    // packet. Take the time before the FIFO frees the slot, or a producer
+    // could stamp a new packet over it.
+    uint16_t rd = midi->tx_ts_rd[producer];
+    uint32_t const age = now - ts[rd];
+    midi->tx_ts_rd[producer] = (uint16_t)(rd + 1 == entries ? 0 : rd + 1);
+#endif
+    tu_fifo_advance_read_pointer(tx_ff, 4);
+#if CFG_MIDI_HOST_TX_CANCEL
+    ++midi->tx_read[producer];
+    if (cancelled)
+      continue;
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    uint32_t max_age = midi->tx_cable_max_age_us[packet[0] >> 4];
+    if (max_age == 0)
+      max_age = midi->tx_max_age_us;
+    if (max_age != 0 && age > max_age && tx_packet_ages(packet))
+    {
+      ++midi->tx_expired;
+      continue;
+    }
+#endif
+#if CFG_MIDI_HOST_TX_CANCEL
+    tx_track_sysex(midi, packet);
+#endif
+    count += 4;
+  }
+  return count;
+}
+#endif
+
+// Return true if there is anything to send to the device
+static inline bool tx_pending(midih_interface_t *midi)
+{
+#if CFG_MIDI_HOST_TX_REALTIME
+  if (midi->tx_rt_rd != midi->tx_rt_wr)
+    return true;
+#endif
+#if CFG_MIDI_HOST_TX_CANCEL
+  if (midi->tx_cancel_f7 != 0 || midi->tx_cancel_seq != midi->tx_cancel_ack)
+    return true;
+#endif
+  return tx_ff_count(midi) != 0;
+}
+
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(write_flush)(uint8_t dev_addr, midih_interface_t* midi)
+{
+  // No data to send
+  if ( !tx_pending(midi) ) return 0;
+
+  // skip if previous transfer not complete
+  TU_VERIFY( usbh_edpt_claim(dev_addr, midi->ep_out) );
+#if CFG_MIDI_HOST_TX_CANCEL
+  tx_cancel_take(midi);
+#endif
+
+  uint16_t count = 0;
+#if CFG_MIDI_HOST_TX_REALTIME
+  // The realtime lane goes first
+  while (midi->tx_rt_rd != midi->tx_rt_wr && count + 4 <= midi->ep_out_max)
+  {
+    memcpy(midi->epout_buf + count, midi->tx_rt[midi->tx_rt_rd % CFG_MIDI_HOST_TX_REALTIME], 4);
+    ++midi->tx_rt_rd;
+    count += 4;
+  }
+#endif
+  // Take whole packets from each producer's FIFO in turn. Start with a
+  // different producer each transfer so no producer can starve the others.
+  uint8_t producer = midi->tx_next_producer;
+  for (int idx = 0; idx < CFG_TUH_MIDI_TX_PRODUCERS && count < midi->ep_out_max; idx++)
+  {
+#if CFG_MIDI_HOST_TX_MAX_AGE || CFG_MIDI_HOST_TX_CANCEL
+    count += tx_read_filtered(midi, producer, midi->epout_buf + count, (uint16_t)((midi->ep_out_max - count) & ~3u));
+#else
+    count += tu_fifo_read_n(&midi->tx_ff[producer], midi->epout_buf + count, (uint16_t)((midi->ep_out_max - count) & ~3u));
+#endif
+    if (++producer == CFG_TUH_MIDI_TX_PRODUCERS)
+      producer = 0;
+  }
+  if (++midi->tx_next_producer == CFG_TUH_MIDI_TX_PRODUCERS)
+    midi->tx_next_producer = 0;
+#if CFG_MIDI_HOST_TX_CANCEL
+  count += tx_cancel_finish(midi, midi->epout_buf + count, (uint16_t)((midi->ep_out_max - count) & ~3u));
+#endif
+
+  if (count)
+  {
+    TU_ASSERT( usbh_edpt_xfer(dev_addr, midi->ep_out, midi->epout_buf, count), 0 );
+#if CFG_MIDI_HOST_TX_WATCHDOG
+    tx_watchdog_start(midi, count);
+#endif
+    return count;
+  }else
+  {
+    // Release endpoint since we don't make any transfer
+    usbh_edpt_release(dev_addr, midi->ep_out);
+    return 0;
+  }
+}
+
+bool CFG_TUH_MIDI_HOT_FUNC(tuh_midi_can_write_stream)(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  return (tu_fifo_remaining(get_tx_ff(p_midi_host)) >= 4);
+}
+
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+static tuh_midi_checksum_rule_t midih_checksum_rules[CFG_MIDI_HOST_SYSEX_CHECKSUM];
+
+bool tuh_midi_set_checksum_rule(uint8_t idx, tuh_midi_checksum_rule_t const *rule)
+{
+  TU_VERIFY(idx < CFG_MIDI_HOST_SYSEX_CHECKSUM && rule->header_len <= TUH_MIDI_CHECKSUM_HEADER_MAX);
+  TU_VERIFY(rule->type <= TUH_MIDI_CHECKSUM_SUM);
+  midih_checksum_rules[idx] = *rule;
+  return true;
+}
+
+// Start the checksum of a new SysEx message
+static void checksum_start(midih_checksum_t *acc, bool tx)
+{
+  acc->candidates = 0;
+  for (uint8_t idx = 0; idx < CFG_MIDI_HOST_SYSEX_CHECKSUM; idx++)
+  {
+    tuh_midi_checksum_rule_t const *rule = &midih_checksum_rules[idx];
+    if (rule->header_len != 0 && (tx ? rule->insert_tx : rule->verify_rx))
+      acc->candidates |= (uint8_t)(1u << idx);
+  }
+  acc->rule = 0;
+  acc->pos = 0;
+  acc->sum = 0;
+  acc->has_data = false;
+}
+
+// Add a SysEx data byte to the checksum
+static void checksum_data(midih_checksum_t *acc, uint8_t data)
+{
+  if (acc->rule)
+  {
+    if (midih_checksum_rules[acc->rule - 1].type == TUH_MIDI_CHECKSUM_XOR)
+      acc->sum ^= data;
+    else
+      acc->sum = (uint8_t)(acc->sum + data);
+    acc->last = data;
+    acc->has_data = true;
+    return;
+  }
+  uint8_t const pos = acc->pos++;
+  for (uint8_t idx = 0; acc->candidates && idx < CFG_MIDI_HOST_SYSEX_CHECKSUM; idx++)
+  {
+    uint8_t const bit = (uint8_t)(1u << idx);
+    tuh_midi_checksum_rule_t const *rule = &midih_checksum_rules[idx];
+    if (!(acc->candidates & bit))
+      continue;
+    if (rule->header[pos] != TUH_MIDI_CHECKSUM_ANY && rule->header[pos] != data)
+    {
+      acc->candidates &= (uint8_t)~bit;
+    }
+    else if (pos + 1 == rule->header_len)
+    {
+      acc->rule = (uint8_t)(idx + 1);
+      acc->candidates = 0;
+    }
+  }
+}
+
+// Return the checksum of the data bytes in sum
+static inline uint8_t checksum_value(uint8_t type, uint8_t sum)
+{
+  if (type == TUH_MIDI_CHECKSUM_ROLAND)
+    sum = (uint8_t)(128 - (sum & 0x7f));
+  return sum & 0x7f;
+}
+#endif
+
+#if CFG_MIDI_HOST_STREAM_WRITE
+uint32_t CFG_TUH_MIDI_HOT_FUNC(tuh_midi_stream_write)(uint8_t dev_addr, uint8_t cable_num, uint8_t const* buffer, uint32_t bufsize)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  TU_VERIFY(cable_num < p_midi_host->num_cables_tx);
+  TU_VERIFY(cable_num < midih_limits.max_cables);
+  uint8_t const producer = CFG_TUH_MIDI_PRODUCER_ID();
+  tu_fifo_t *tx_ff = &p_midi_host->tx_ff[producer];
+  midi_stream_t *stream = &p_midi_host->stream_write[producer*midih_limits.max_cables + cable_num];
+
+  uint32_t i = 0;
+  uint8_t const CN_ = cable_num << 4;
+
+  while ( (i < bufsize) && (tu_fifo_remaining(tx_ff) >= 4) )
+  {
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+    uint8_t data = buffer[i];
+    midih_checksum_t *acc = &stream->checksum;
+    if (data == MIDI_STATUS_SYSEX_END && acc->rule)
+    {
+      // send the checksum now and the F7 next time around
+      data = checksum_value(midih_checksum_rules[acc->rule - 1].type, acc->sum);
+      acc->rule = 0;
+    }
+    else
+    {
+      if (data == MIDI_STATUS_SYSEX_START)
+        checksum_start(acc, true);
+      else if (data <= MIDI_MAX_DATA_VAL)
+        checksum_data(acc, data);
+      else if (data < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+        acc->rule = acc->candidates = 0;
+      i++;
+    }
+#else
+    uint8_t const data = buffer[i];
+    i++;
+#endif
+
+    if (data >= MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+    {
+        // real-time messages need to be sent right away
+        midi_stream_t streamrt;
+        streamrt.buffer[0] = CN_ + MIDI_CIN_1BYTE_DATA;
+        streamrt.buffer[1] = data;
+        streamrt.buffer[2] = 0;
+        streamrt.buffer[3] = 0;
+
+        uint16_t const count = tx_ff_write(p_midi_host, tx_ff, streamrt.buffer);
+        // FIFO overflown, since we already check fifo remaining. It is probably race condition
+        TU_ASSERT(count == 4, i);
+    }
+    else if ( stream->index == 0 )
+    {
+      //------------- New event packet -------------//
+
+      uint8_t const msg = data >> 4;
+      uint8_t const _msg = (stream->buffer[0]) & 0x0F;
+      stream->index = 2;
+      //stream->buffer[1] = data; //first check if its a running status byte, then update
+      stream->total = 4;
+
+      // Check to see if we're still in a SysEx transmit.
+      if ( _msg == MIDI_CIN_SYSEX_START)
+      {
+        stream->buffer[1] = data;
+
+        if ( data == MIDI_STATUS_SYSEX_END )
+        {
+          stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_END_1BYTE;
+          stream->total = 2;
+        }
+      }
+      else if (msg < 0x8 && _msg >= 0x8 && _msg < 0xF)   //Running Status ?
+      {
+        //stream->buffer[0] leave;
+        //stream->buffer[1] leave;
+        stream->buffer[2] = data;
+
+        if (_msg < 0xC || _msg == 0xE)
+        {
+            stream->index = 3;
+        }
+        else    //if (_msg < 0xF)
+        {
+            stream->index = 3;
+            stream->total = 3;
+        }
+      }
+      else if ( (msg >= 0x8 && msg <= 0xB) || msg == 0xE )
+      {
+        // Channel Voice Messages
+        stream->buffer[1] = data;
+        stream->buffer[0] = CN_ + msg;
+      }
+      else if ( msg == 0xC || msg == 0xD)
+      {
+        // Channel Voice Messages, two-byte variants (Program Change and Channel Pressure)
+        stream->buffer[1] = data;
+        stream->buffer[0] = CN_ + msg;
+        stream->total = 3;
+      }
+      else if ( msg == 0xf )
+      {
+        // System message
+        stream->buffer[1] = data;
+
+        if ( data == MIDI_STATUS_SYSEX_START )
+        {
+          stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_START;
+        }
+        else if ( data == MIDI_STATUS_SYSCOM_TIME_CODE_QUARTER_FRAME || data == MIDI_STATUS_SYSCOM_SONG_SELECT )
+        {
+          stream->buffer[0] = CN_ + MIDI_CIN_SYSCOM_2BYTE;
+          stream->total = 3;
+        }
+        else if ( data == MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER )
+        {
+          stream->buffer[0] = CN_ + MIDI_CIN_SYSCOM_3BYTE;
+        }
+        else        //for example, MIDI_STATUS_SYSCOM_TUNE_REQUEST
+        {
+          stream->buffer[0] = CN_ + MIDI_CIN_1BYTE_DATA;
+          stream->total = 2;
+        }
+      }
+      else
+      {
+        // Pack individual bytes if we don't support packing them into words.
+        stream->buffer[1] = data;
+        stream->buffer[0] = CN_ + 0xF;
+        stream->index = 2;
+        stream->total = 2;
+      }
+    }   //End of: if (stream->index == 0)
+    else
+    {
+      //------------- On-going (buffering) packet -------------//
+
+      TU_ASSERT(stream->index < 4, i);
+      stream->buffer[stream->index] = data;
+      stream->index++;
+      // See if this byte ends a SysEx.
+      if ( stream->buffer[0] == CN_ + MIDI_CIN_SYSEX_START && data == MIDI_STATUS_SYSEX_END )
+      {
+        stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_START + (stream->index - 1);   //END +1/+2/+3 Bytes
+        stream->total = stream->index;
+      }
+    }
+
+    // Send out packet
+    if ( stream->index >= 2 && stream->index >= stream->total )
+    {
+      //zeroes unused bytes
+      for(uint8_t idx = stream->total; idx < 4; idx++) stream->buffer[idx] = 0;
+      TU_LOG3_MEM(stream->buffer, 4, 2);
+
+      uint16_t const count = tx_ff_write(p_midi_host, tx_ff, stream->buffer);
+#if CFG_MIDI_HOST_STATE_CHASE
+      chase_capture(p_midi_host, stream->buffer);
+#endif
+
+      stream->index = 0;
+
+      // FIFO overflown, since we already check fifo remaining. It is probably race condition
+      TU_ASSERT(count == 4, i);
+    }
+  }
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+  if ((stream->buffer[0] & 0xf) == MIDI_CIN_SYSEX_START)
+    stream->sysex_us = CFG_TUH_MIDI_TIME_US();
+#endif
+
+  return i;
+}
+#endif
+
+bool CFG_TUH_MIDI_HOT_FUNC(tuh_midi_packet_write)(uint8_t dev_addr, uint8_t const packet[4])
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+
+  tu_fifo_t *tx_ff = get_tx_ff(p_midi_host);
+  if (tu_fifo_remaining(tx_ff) < 4)
+  {
+    return false;
+  }
+
+  tx_ff_write(p_midi_host, tx_ff, packet);
+#if CFG_MIDI_HOST_STATE_CHASE
+  chase_capture(p_midi_host, packet);
+#endif
+
+  return true;
+}
+
+#if CFG_MIDI_HOST_TX_REALTIME
+bool CFG_TUH_MIDI_HOT_FUNC(tuh_midi_packet_write_realtime)(uint8_t dev_addr, uint8_t const packet[4])
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && p_midi_host->ep_out != 0);
+  uint8_t wr = p_midi_host->tx_rt_wr;
+  TU_VERIFY((uint8_t)(wr - p_midi_host->tx_rt_rd) < CFG_MIDI_HOST_TX_REALTIME);
+  memcpy(p_midi_host->tx_rt[wr % CFG_MIDI_HOST_TX_REALTIME], packet, 4);
+  p_midi_host->tx_rt_wr = (uint8_t)(wr + 1);
+  tuh_midi_stream_flush(dev_addr);
+  return true;
+}
+#endif
+
+uint32_t CFG_TUH_MIDI_HOT_FUNC(tuh_midi_stream_flush)( uint8_t dev_addr )
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+
+  uint32_t bytes_flushed = 0;
+  if (!usbh_edpt_busy(p_midi_host->dev_addr, p_midi_host->ep_out))
+  {
+    bytes_flushed = write_flush(dev_addr, p_midi_host);
+  }
+  return bytes_flushed;
+}
+
+uint32_t tuh_midi_stream_flush_rhport(uint8_t rhport)
+{
+  uint32_t bytes_flushed = 0;
+  for (uint8_t dev_addr = 1; dev_addr <= CFG_TUH_DEVICE_MAX; dev_addr++)
+  {
+    midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+    if (p_midi_host->configured && p_midi_host->rhport == rhport && p_midi_host->ep_out != 0)
+    {
+      bytes_flushed += tuh_midi_stream_flush(dev_addr);
+    }
+  }
+  return bytes_flushed;
+}
+
+//--------------------------------------------------------------------+
+// Timed features
+//--------------------------------------------------------------------+
+#ifdef CFG_TUH_MIDI_TIME_US
+uint32_t tuh_midi_time_us(void)
+{
+  return CFG_TUH_MIDI_TIME_US();
+}
+#endif
+
+#if CFG_MIDI_HOST_TX_SCHEDULE
+static inline uint16_t sched_index(midih_interface_t *p_midi_host, uint16_t n)
+{
+  return (uint16_t)((p_midi_host->tx_sched_head + n) % CFG_MIDI_HOST_TX_SCHEDULE);
+}
+
+bool tuh_midi_packet_write_at(uint8_t dev_addr, uint8_t const packet[4], uint32_t due_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  TU_VERIFY(p_midi_host->tx_sched_count < CFG_MIDI_HOST_TX_SCHEDULE);
+  due_us -= (uint32_t)(p_midi_host->tx_offset_us + p_midi_host->tx_cable_offset_us[packet[0] >> 4]);
+  // Search back from the latest packet for the place to insert this one.
+  // Packets are usually queued in time order, so this rarely moves any.
+  uint16_t pos = p_midi_host->tx_sched_count;
+  while (pos > 0)
+  {
+    uint16_t prev = sched_index(p_midi_host, pos - 1);
+    if ((int32_t)(p_midi_host->tx_sched[prev].due_us - due_us) <= 0)
+      break;
+    p_midi_host->tx_sched[sched_index(p_midi_host, pos)] = p_midi_host->tx_sched[prev];
+    --pos;
+  }
+  uint16_t idx = sched_index(p_midi_host, pos);
+  p_midi_host->tx_sched[idx].due_us = due_us;
+  memcpy(p_midi_host->tx_sched[idx].packet, packet, 4);
+  ++p_midi_host->tx_sched_count;
+  return true;
+}
+
+bool tuh_midi_set_tx_offset(uint8_t dev_addr, int32_t offset_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  p_midi_host->tx_offset_us = offset_us;
+  return true;
+}
+
+bool tuh_midi_set_tx_cable_offset(uint8_t dev_addr, uint8_t cable, int32_t offset_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && cable < 16);
+  p_midi_host->tx_cable_offset_us[cable] = offset_us;
+  return true;
+}
+
+int32_t tuh_midi_get_tx_offset(uint8_t dev_addr, uint8_t cable)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && cable < 16, 0);
+  return p_midi_host->tx_offset_us + p_midi_host->tx_cable_offset_us[cable];
+}
+
+uint32_t tuh_midi_schedule_available(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured, 0);
+  return CFG_MIDI_HOST_TX_SCHEDULE - p_midi_host->tx_sched_count;
+}
+
+// Move the packets that are due to the OUT queue
+static void schedule_release(uint8_t dev_addr, midih_interface_t *p_midi_host, uint32_t now)
+{
+  bool released = false;
+  while (p_midi_host->tx_sched_count)
+  {
+    uint8_t const *packet = p_midi_host->tx_sched[p_midi_host->tx_sched_head].packet;
+    if ((int32_t)(now - p_midi_host->tx_sched[p_midi_host->tx_sched_head].due_us) < 0)
+      break;
+    if (!tuh_midi_packet_write(dev_addr, packet))
+      break; // the OUT queue is full; try again next time
+    p_midi_host->tx_sched_head = sched_index(p_midi_host, 1);
+    --p_midi_host->tx_sched_count;
+    released = true;
+  }
+  if (released)
+    tuh_midi_stream_flush(dev_addr);
+}
+#endif
+
+#if CFG_MIDI_HOST_RX_DEJITTER
+bool tuh_midi_set_rx_dejitter(uint8_t dev_addr, uint32_t delay_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  p_midi_host->rx_jit_delay_us = delay_us;
+  return true;
+}
+
+uint32_t tuh_midi_get_rx_dejitter_early(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, 0);
+  return p_midi_host->rx_jit_early;
+}
+#endif
+
+#if CFG_MIDI_HOST_RX_SHED
+bool tuh_midi_rx_shed_set(uint8_t cls, uint8_t level)
+{
+  TU_VERIFY(cls < TUH_MIDI_NUM_CLASSES && level <= 16);
+  midih_rx_shed_level[cls] = level;
+  return true;
+}
+
+uint32_t tuh_midi_rx_dropped(uint8_t dev_addr, uint8_t cls)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && cls < TUH_MIDI_NUM_CLASSES, 0);
+  return p_midi_host->rx_dropped[cls];
+}
+#endif
+
+#if CFG_MIDI_HOST_RX_STATE
+// Return the state of channel chan of cable or NULL if it is not mirrored
+static midih_rx_chan_state_t *rx_state_get(uint8_t dev_addr, uint8_t cable, uint8_t chan)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && cable < CFG_MIDI_HOST_RX_STATE_CABLES && chan < 16, NULL);
+  return &p_midi_host->rx_state[cable][chan];
+}
+
+uint8_t tuh_midi_state_cc(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t cc)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL && cc <= MIDI_MAX_DATA_VAL, 0xFF);
+  return state->cc[cc];
+}
+
+uint16_t tuh_midi_state_pitch_bend(uint8_t dev_addr, uint8_t cable, uint8_t chan)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL, 0xFFFF);
+  return state->pitch_bend;
+}
+
+uint8_t tuh_midi_state_channel_pressure(uint8_t dev_addr, uint8_t cable, uint8_t chan)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL, 0xFF);
+  return state->channel_pressure;
+}
+
+uint8_t tuh_midi_state_program(uint8_t dev_addr, uint8_t cable, uint8_t chan)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL, 0xFF);
+  return state->program;
+}
+
+uint8_t tuh_midi_state_poly_pressure(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t note)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL && note <= MIDI_MAX_DATA_VAL, 0xFF);
+  return state->poly_pressure[note];
+}
+
+bool tuh_midi_state_note_held(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t note)
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL && note <= MIDI_MAX_DATA_VAL);
+  return (state->notes[note / 8] & (1u << (note % 8))) != 0;
+}
+
+bool tuh_midi_state_notes_held(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t notes[16])
+{
+  midih_rx_chan_state_t *state = rx_state_get(dev_addr, cable, chan);
+  TU_VERIFY(state != NULL);
+  memcpy(notes, state->notes, sizeof(state->notes));
+  return true;
+}
+#endif
+
+#if CFG_MIDI_HOST_TX_MAX_AGE
+bool tuh_midi_set_tx_max_age(uint8_t dev_addr, uint32_t max_age_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  p_midi_host->tx_max_age_us = max_age_us;
+  return true;
+}
+
+bool tuh_midi_set_tx_cable_max_age(uint8_t dev_addr, uint8_t cable, uint32_t max_age_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && cable < 16);
+  p_midi_host->tx_cable_max_age_us[cable] = max_age_us;
+  return true;
+}
+
+uint32_t tuh_midi_tx_expired(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, 0);
+  return p_midi_host->tx_expired;
+}
+#endif
+
+#if CFG_MIDI_HOST_TX_CANCEL
+bool tuh_midi_tx_cancel(uint8_t dev_addr, uint16_t cable_mask)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && p_midi_host->ep_out != 0);
+#if CFG_MIDI_HOST_STREAM_WRITE
+  // Forget the partial message in the caller's encoder
+  uint8_t const producer = CFG_TUH_MIDI_PRODUCER_ID();
+  for (uint8_t cable = 0; cable < midih_limits.max_cables; cable++)
+  {
+    if (cable_mask & (1u << cable))
+      tu_memclr(&p_midi_host->stream_write[producer*midih_limits.max_cables + cable], sizeof(midi_stream_t));
+  }
+#endif
+#if CFG_MIDI_HOST_TX_SCHEDULE
+  // Remove the cables' packets from the schedule, keeping the order of the rest
+  uint16_t kept = 0;
+  for (uint16_t n = 0; n < p_midi_host->tx_sched_count; n++)
+  {
+    uint16_t idx = sched_index(p_midi_host, n);
+    if (!(cable_mask & (1u << (p_midi_host->tx_sched[idx].packet[0] >> 4))))
+      p_midi_host->tx_sched[sched_index(p_midi_host, kept++)] = p_midi_host->tx_sched[idx];
   }
+  p_midi_host->tx_sched_count = kept;
 #endif
-  if (in_desc)
+  // If write_flush() has not taken the last request yet, add to it
+  if (p_midi_host->tx_cancel_seq == p_midi_host->tx_cancel_ack)
+    p_midi_host->tx_cancel_req_mask = 0;
+  p_midi_host->tx_cancel_req_mask |= cable_mask;
+  for (int idx = 0; idx < CFG_TUH_MIDI_TX_PRODUCERS; idx++)
   {
-    TU_ASSERT(tuh_edpt_open(dev_addr, in_desc));
-    // Some devices always return exactly the request length so transfers won't complete
-    // unless you assume every transfer is the last one.
-    // TODO usbh_edpt_force_last_buffer(dev_addr, p_midi_host->ep_in, true);
+    p_midi_host->tx_cancel_req_mark[idx] = p_midi_host->tx_written[idx];
   }
-  if (out_desc)
+  p_midi_host->tx_cancel_seq = (uint8_t)(p_midi_host->tx_cancel_seq + 1);
+  tuh_midi_stream_flush(dev_addr);
+  return true;
+}
+#endif
+
+#if CFG_MIDI_HOST_RX_TAP
+void tuh_midi_rx_tap_enable(bool enable)
+{
+  if (enable && !midih_rx_tap.enabled)
   {
-    TU_ASSERT(tuh_edpt_open(dev_addr, out_desc));
+    // start with an empty ring; the consumer owns rd
+    midih_rx_tap.rd = midih_rx_tap.wr;
+    midih_rx_tap.dropped = 0;
   }
-  p_midi_host->dev_addr = dev_addr;
+  midih_rx_tap.enabled = enable;
+}
 
+bool tuh_midi_rx_tap_read(tuh_midi_rx_event_t *event)
+{
+  uint32_t rd = midih_rx_tap.rd;
+  TU_VERIFY(rd != midih_rx_tap.wr);
+  *event = midih_rx_tap.event[rd % CFG_MIDI_HOST_RX_TAP];
+  midih_rx_tap.rd = rd + 1;
   return true;
 }
 
-bool tuh_midi_configured(uint8_t dev_addr)
+uint32_t tuh_midi_rx_tap_dropped(void)
 {
-  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
-  return p_midi_host->configured;
+  return midih_rx_tap.dropped;
 }
+#endif
 
-bool midih_set_config(uint8_t dev_addr, uint8_t itf_num)
+#if CFG_MIDI_HOST_LATENCY_PROBE
+// The SysEx probe is F0 7D 4C <sequence MSB> <sequence LSB> F7, where 7D is
+// the non-commercial manufacturer ID. The Note probe is a Note On on MIDI
+// channel 16, note 0, with a velocity from the sequence, then a Note Off.
+#define PROBE_SYSEX_ID 0x4C
+#define PROBE_NOTE_CHAN 0x0F
+#define PROBE_NOTE 0
+
+bool tuh_midi_latency_probe(uint8_t dev_addr, uint8_t cable, bool sysex)
 {
-  (void) itf_num;
-  TU_LOG2("Set config dev_addr=%u\r\n", dev_addr);
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
-  p_midi_host->configured = true;
-
-  TU_LOG2("Requesting poll IN endpoint %d\r\n", p_midi_host->ep_in);
-  TU_ASSERT(usbh_edpt_xfer(p_midi_host->dev_addr, p_midi_host->ep_in, p_midi_host->epin_buf, p_midi_host->ep_in_max), 0);
-  if (tuh_midi_mount_cb)
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && p_midi_host->ep_out != 0 && p_midi_host->ep_in != 0);
+  TU_VERIFY(!p_midi_host->probe_pending);
+  // The probe must go out now, not after other queued packets,
+  // or the queue time would count as latency
+  TU_VERIFY(tx_ff_count(p_midi_host) == 0 && !usbh_edpt_busy(dev_addr, p_midi_host->ep_out));
+  uint16_t seq = (uint16_t)((p_midi_host->probe_seq + 1) & 0x3FFF);
+  uint8_t const cn = (uint8_t)(cable << 4);
+  if (sysex)
   {
-    tuh_midi_mount_cb(dev_addr, p_midi_host->ep_in, p_midi_host->ep_out, p_midi_host->num_cables_rx, p_midi_host->num_cables_tx);
+    uint8_t const head[4] = {(uint8_t)(cn | MIDI_CIN_SYSEX_START), 0xF0, 0x7D, PROBE_SYSEX_ID};
+    uint8_t const tail[4] = {(uint8_t)(cn | MIDI_CIN_SYSEX_END_3BYTE), (uint8_t)(seq >> 7), (uint8_t)(seq & 0x7f), 0xF7};
+    TU_VERIFY(tuh_midi_packet_write(dev_addr, head) && tuh_midi_packet_write(dev_addr, tail));
   }
-  usbh_driver_set_config_complete(dev_addr, itf_num);
+  else
+  {
+    uint8_t const note_on[4] = {(uint8_t)(cn | MIDI_CIN_NOTE_ON), 0x90 | PROBE_NOTE_CHAN, PROBE_NOTE, (uint8_t)(seq % 127 + 1)};
+    uint8_t const note_off[4] = {(uint8_t)(cn | MIDI_CIN_NOTE_OFF), 0x80 | PROBE_NOTE_CHAN, PROBE_NOTE, 0};
+    TU_VERIFY(tuh_midi_packet_write(dev_addr, note_on) && tuh_midi_packet_write(dev_addr, note_off));
+  }
+  p_midi_host->probe_note_off = false;
+  p_midi_host->probe_seq = seq;
+  p_midi_host->probe_sysex = sysex;
+  p_midi_host->probe_sent_us = CFG_TUH_MIDI_TIME_US();
+  p_midi_host->probe_pending = true;
+  tuh_midi_stream_flush(dev_addr);
   return true;
 }
 
-//--------------------------------------------------------------------+
-// Stream API
-//--------------------------------------------------------------------+
-static uint32_t write_flush(uint8_t dev_addr, midih_interface_t* midi)
+static void latency_record(midih_interface_t *p_midi_host, uint32_t now)
 {
-  // No data to send
-  if ( !tu_fifo_count(&midi->tx_ff) ) return 0;
-
-  // skip if previous transfer not complete
-  TU_VERIFY( usbh_edpt_claim(dev_addr, midi->ep_out) );
-
-  uint16_t count = tu_fifo_read_n(&midi->tx_ff, midi->epout_buf, midi->ep_out_max);
+  uint32_t rtt_us = now - p_midi_host->probe_sent_us;
+  tuh_midi_latency_stats_t *stats = &p_midi_host->latency;
+  if (stats->count == 0 || rtt_us < stats->min_us)
+    stats->min_us = rtt_us;
+  if (rtt_us > stats->max_us)
+    stats->max_us = rtt_us;
+  stats->last_us = rtt_us;
+  stats->sum_us += rtt_us;
+  ++stats->count;
+  p_midi_host->probe_pending = false;
+  if (tuh_midi_latency_cb)
+    tuh_midi_latency_cb(p_midi_host->dev_addr, rtt_us);
+}
 
-  if (count)
+// Consume the echo of the pending probe. The echo may come back on any
+// cable, because a loopback may route it to a different port.
+static bool CFG_TUH_MIDI_HOT_FUNC(latency_match)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  uint8_t const cin = buf[0] & 0xf;
+  if (p_midi_host->probe_sysex)
   {
-    TU_ASSERT( usbh_edpt_xfer(dev_addr, midi->ep_out, midi->epout_buf, count), 0 );
-    return count;
-  }else
+    if (cin == MIDI_CIN_SYSEX_START && buf[1] == 0xF0 && buf[2] == 0x7D && buf[3] == PROBE_SYSEX_ID)
+    {
+      p_midi_host->probe_sysex_head = true;
+      p_midi_host->probe_head_cable = buf[0] >> 4;
+      return true;
+    }
+    // Only the next packet on the cable of the head can be the tail.
+    // Real time messages may come in between.
+    if (!p_midi_host->probe_sysex_head || (buf[0] >> 4) != p_midi_host->probe_head_cable ||
+        (cin == MIDI_CIN_1BYTE_DATA && buf[1] >= 0xF8))
+      return false;
+    p_midi_host->probe_sysex_head = false;
+    if (cin != MIDI_CIN_SYSEX_END_3BYTE || buf[3] != MIDI_STATUS_SYSEX_END)
+      return false;
+    if (buf[1] == (p_midi_host->probe_seq >> 7) && buf[2] == (p_midi_host->probe_seq & 0x7f))
+      latency_record(p_midi_host, CFG_TUH_MIDI_TIME_US());
+    return true;
+  }
+  if (buf[1] == (0x90 | PROBE_NOTE_CHAN) && buf[2] == PROBE_NOTE && buf[3] == p_midi_host->probe_seq % 127 + 1)
   {
-    // Release endpoint since we don't make any transfer
-    usbh_edpt_release(dev_addr, midi->ep_out);
-    return 0;
+    p_midi_host->probe_note_off = true;
+    latency_record(p_midi_host, CFG_TUH_MIDI_TIME_US());
+    return true;
   }
+  return false;
 }
 
-bool tuh_midi_can_write_stream (uint8_t dev_addr)
+// Consume the Note Off echo that follows the matched Note probe echo.
+// A loopback may turn the Note Off into a Note On with velocity 0.
+static inline bool latency_match_note_off(midih_interface_t *p_midi_host, uint8_t const *buf)
 {
-  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  return (tu_fifo_remaining(&p_midi_host->tx_ff) >= 4);
+  if ((buf[1] == (0x80 | PROBE_NOTE_CHAN) || (buf[1] == (0x90 | PROBE_NOTE_CHAN) && buf[3] == 0)) && buf[2] == PROBE_NOTE)
+  {
+    p_midi_host->probe_note_off = false;
+    return true;
+  }
+  return false;
 }
 
-uint32_t tuh_midi_stream_write (uint8_t dev_addr, uint8_t cable_num, uint8_t const* buffer, uint32_t bufsize)
+bool tuh_midi_latency_get_stats(uint8_t dev_addr, tuh_midi_latency_stats_t *stats)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
-  TU_VERIFY(cable_num < p_midi_host->num_cables_tx);
-  TU_VERIFY(cable_num < midih_limits.max_cables);
-  midi_stream_t *stream = &p_midi_host->stream_write[cable_num];
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  *stats = p_midi_host->latency;
+  return true;
+}
 
-  uint32_t i = 0;
-  uint8_t const CN_ = cable_num << 4;
+void tuh_midi_latency_reset(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, );
+  tu_memclr(&p_midi_host->latency, sizeof(p_midi_host->latency));
+}
 
-  while ( (i < bufsize) && (tu_fifo_remaining(&p_midi_host->tx_ff) >= 4) )
+static void latency_timeout(midih_interface_t *p_midi_host, uint32_t now)
+{
+  if (p_midi_host->probe_pending && now - p_midi_host->probe_sent_us > CFG_TUH_MIDI_LATENCY_TIMEOUT_US)
   {
-    uint8_t const data = buffer[i];
-    i++;
+    p_midi_host->probe_pending = false;
+    p_midi_host->probe_sysex_head = false;
+    ++p_midi_host->latency.lost;
+  }
+  // Do not keep waiting for a Note Off echo that got lost, or the
+  // application's own Note Off for channel 16, note 0 would be taken
+  if (p_midi_host->probe_note_off && now - p_midi_host->probe_sent_us > CFG_TUH_MIDI_LATENCY_TIMEOUT_US)
+    p_midi_host->probe_note_off = false;
+}
+#endif
 
-    if (data >= MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+// Put the next packet of the message being sent in packet.
+// Returns true if the packet ends the message.
+static bool hs_next_packet(midih_interface_t *p_midi_host, uint8_t packet[4])
+{
+  uint8_t n = 0;
+  tu_memclr(packet, 4);
+  while (n < 3 && p_midi_host->hs_pos < p_midi_host->hs_len)
+  {
+    uint8_t const byte = p_midi_host->hs_data[p_midi_host->hs_pos++];
+    packet[1 + n++] = byte;
+    if (byte == MIDI_STATUS_SYSEX_END)
     {
-        // real-time messages need to be sent right away
-        midi_stream_t streamrt;
-        streamrt.buffer[0] = CN_ + MIDI_CIN_1BYTE_DATA;
-        streamrt.buffer[1] = data;
-        streamrt.buffer[2] = 0;
-        streamrt.buffer[3] = 0;
-
-        uint16_t const count = tu_fifo_write_n(&p_midi_host->tx_ff, streamrt.buffer, 4);
-        // FIFO overflown, since we already check fifo remaining. It is probably race condition
-        TU_ASSERT(count == 4, i);
+      packet[0] = (uint8_t)((p_midi_host->hs_cable << 4) | (MIDI_CIN_SYSEX_END_1BYTE + n - 1));
+      return true;
     }
-    else if ( stream->index == 0 )
+  }
+  packet[0] = (uint8_t)((p_midi_host->hs_cable << 4) | MIDI_CIN_SYSEX_START);
+  return p_midi_host->hs_pos >= p_midi_host->hs_len; // tuh_midi_sysex_transfer() checked the data ends with F7
+}
+
+// Queue as much of the message being sent as fits in the OUT FIFO
+static void hs_continue(midih_interface_t *p_midi_host)
+{
+  uint8_t packet[4];
+  tu_fifo_t *tx_ff = get_tx_ff(p_midi_host);
+  while (tu_fifo_remaining(tx_ff) >= 4)
+  {
+    bool const last = hs_next_packet(p_midi_host, packet);
+    tx_ff_write(p_midi_host, tx_ff, packet);
+    if (last)
     {
-      //------------- New event packet -------------//
+      p_midi_host->hs_state = MIDIH_HS_WAITING;
+      p_midi_host->hs_sent_us = CFG_TUH_MIDI_TIME_US();
+      return;
+    }
+  }
+}
 
-      uint8_t const msg = data >> 4;
-      uint8_t const _msg = (stream->buffer[0]) & 0x0F;
-      stream->index = 2;
-      //stream->buffer[1] = data; //first check if its a running status byte, then update
-      stream->total = 4;
+// End the partly queued message of an aborted transfer with F7 once there
+// is room for it in the OUT FIFO, and only then report the abort
+static void hs_end(midih_interface_t *p_midi_host)
+{
+  tu_fifo_t *tx_ff = get_tx_ff(p_midi_host);
+  if (tu_fifo_remaining(tx_ff) < 4)
+  {
+    p_midi_host->hs_state = MIDIH_HS_ENDING;
+    return;
+  }
+  uint8_t const packet[4] = {(uint8_t)((p_midi_host->hs_cable << 4) | MIDI_CIN_SYSEX_END_1BYTE), MIDI_STATUS_SYSEX_END, 0, 0};
+  tx_ff_write(p_midi_host, tx_ff, packet);
+  write_flush(p_midi_host->dev_addr, p_midi_host);
+  hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_ABORTED);
+}
 
-      // Check to see if we're still in a SysEx transmit.
-      if ( _msg == MIDI_CIN_SYSEX_START)
-      {
-        stream->buffer[1] = data;
+static void hs_finish(midih_interface_t *p_midi_host, uint8_t result)
+{
+  p_midi_host->hs_state = MIDIH_HS_IDLE;
+  if (p_midi_host->hs_held)
+  {
+    // nothing else will complete the held packet
+    p_midi_host->hs_held = false;
+    if (rx_accept(p_midi_host, p_midi_host->hs_head) && tuh_midi_rx_cb)
+      tuh_midi_rx_cb(p_midi_host->dev_addr, 1);
+  }
+  if (tuh_midi_sysex_transfer_cb)
+    tuh_midi_sysex_transfer_cb(p_midi_host->dev_addr, result, p_midi_host->hs_msg_start);
+}
 
-        if ( data == MIDI_STATUS_SYSEX_END )
-        {
-          stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_END_1BYTE;
-          stream->total = 2;
-        }
-      }
-      else if (msg < 0x8 && _msg >= 0x8 && _msg < 0xF)   //Running Status ?
-      {
-        //stream->buffer[0] leave;
-        //stream->buffer[1] leave;
-        stream->buffer[2] = data;
+// Send the next message or the same one again
+static void hs_send(midih_interface_t *p_midi_host, bool next)
+{
+  if (next)
+  {
+    p_midi_host->hs_msg_start = p_midi_host->hs_pos;
+    p_midi_host->hs_naks = 0;
+    if (p_midi_host->hs_pos >= p_midi_host->hs_len)
+    {
+      hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_DONE);
+      return;
+    }
+  }
+  else
+  {
+    p_midi_host->hs_pos = p_midi_host->hs_msg_start;
+  }
+  p_midi_host->hs_state = MIDIH_HS_SENDING;
+  hs_continue(p_midi_host);
+  write_flush(p_midi_host->dev_addr, p_midi_host);
+}
 
-        if (_msg < 0xC || _msg == 0xE)
-        {
-            stream->index = 3;
-        }
-        else    //if (_msg < 0xF)
-        {
-            stream->index = 3;
-            stream->total = 3;
-        }
-      }
-      else if ( (msg >= 0x8 && msg <= 0xB) || msg == 0xE )
-      {
-        // Channel Voice Messages
-        stream->buffer[1] = data;
-        stream->buffer[0] = CN_ + msg;
-      }
-      else if ( msg == 0xC || msg == 0xD)
-      {
-        // Channel Voice Messages, two-byte variants (Program Change and Channel Pressure)
-        stream->buffer[1] = data;
-        stream->buffer[0] = CN_ + msg;
-        stream->total = 3;
-      }
-      else if ( msg == 0xf )
-      {
-        // System message
-        stream->buffer[1] = data;
+// Hold the first packet of what may be a handshake reply on the cable
+static bool CFG_TUH_MIDI_HOT_FUNC(hs_match_head)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  if (buf[0] != ((p_midi_host->hs_cable << 4) | MIDI_CIN_SYSEX_START) ||
+      buf[1] != MIDI_STATUS_SYSEX_START || buf[2] != 0x7E)
+    return false;
+  memcpy(p_midi_host->hs_head, buf, 4);
+  p_midi_host->hs_held = true;
+  return true;
+}
 
-        if ( data == MIDI_STATUS_SYSEX_START )
-        {
-          stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_START;
-        }
-        else if ( data == MIDI_STATUS_SYSCOM_TIME_CODE_QUARTER_FRAME || data == MIDI_STATUS_SYSCOM_SONG_SELECT )
-        {
-          stream->buffer[0] = CN_ + MIDI_CIN_SYSCOM_2BYTE;
-          stream->total = 3;
-        }
-        else if ( data == MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER )
-        {
-          stream->buffer[0] = CN_ + MIDI_CIN_SYSCOM_3BYTE;
-        }
-        else        //for example, MIDI_STATUS_SYSCOM_TUNE_REQUEST
-        {
-          stream->buffer[0] = CN_ + MIDI_CIN_1BYTE_DATA;
-          stream->total = 2;
-        }
-      }
+// Act on a handshake reply if buf completes one; hs_head holds the
+// first packet. The packet number in the reply is not checked.
+static bool CFG_TUH_MIDI_HOT_FUNC(hs_match_tail)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  if ((buf[0] & 0xf) != MIDI_CIN_SYSEX_END_3BYTE || buf[3] != MIDI_STATUS_SYSEX_END)
+    return false;
+  switch (buf[1])
+  {
+    case 0x7F: // ACK
+      hs_send(p_midi_host, true);
+      return true;
+    case 0x7E: // NAK
+      if (++p_midi_host->hs_naks > CFG_TUH_MIDI_HANDSHAKE_RETRIES)
+        hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_FAILED);
       else
-      {
-        // Pack individual bytes if we don't support packing them into words.
-        stream->buffer[1] = data;
-        stream->buffer[0] = CN_ + 0xF;
-        stream->index = 2;
-        stream->total = 2;
-      }
-    }   //End of: if (stream->index == 0)
-    else
-    {
-      //------------- On-going (buffering) packet -------------//
+        hs_send(p_midi_host, false);
+      return true;
+    case 0x7C: // WAIT
+      p_midi_host->hs_state = MIDIH_HS_PAUSED;
+      return true;
+    case 0x7D: // CANCEL
+      hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_CANCELLED);
+      return true;
+    default:
+      return false;
+  }
+}
 
-      TU_ASSERT(stream->index < 4, i);
-      stream->buffer[stream->index] = data;
-      stream->index++;
-      // See if this byte ends a SysEx.
-      if ( stream->buffer[0] == CN_ + MIDI_CIN_SYSEX_START && data == MIDI_STATUS_SYSEX_END )
-      {
-        stream->buffer[0] = CN_ + MIDI_CIN_SYSEX_START + (stream->index - 1);   //END +1/+2/+3 Bytes
-        stream->total = stream->index;
-      }
-    }
+// A receiver that does not answer in time does not handshake
+static void hs_timeout(uint8_t dev_addr, midih_interface_t *p_midi_host, uint32_t now)
+{
+  (void)dev_addr;
+  if (p_midi_host->hs_state == MIDIH_HS_ENDING)
+    hs_end(p_midi_host); // the OUT queue may have been dropped
+  if (p_midi_host->hs_state == MIDIH_HS_WAITING && p_midi_host->hs_timeout_us != 0 && !p_midi_host->hs_held &&
+      now - p_midi_host->hs_sent_us > p_midi_host->hs_timeout_us)
+  {
+    hs_send(p_midi_host, true);
+  }
+}
 
-    // Send out packet
-    if ( stream->index >= 2 && stream->index >= stream->total )
-    {
-      //zeroes unused bytes
-      for(uint8_t idx = stream->total; idx < 4; idx++) stream->buffer[idx] = 0;
-      TU_LOG3_MEM(stream->buffer, 4, 2);
+bool tuh_midi_sysex_transfer(uint8_t dev_addr, uint8_t cable, uint8_t const *data, uint32_t len, uint32_t timeout_us)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && p_midi_host->ep_out != 0);
+  TU_VERIFY(p_midi_host->hs_state == MIDIH_HS_IDLE && cable < p_midi_host->num_cables_tx);
+  TU_VERIFY(len >= 2 && data[0] == MIDI_STATUS_SYSEX_START && data[len-1] == MIDI_STATUS_SYSEX_END);
+  p_midi_host->hs_data = data;
+  p_midi_host->hs_len = len;
+  p_midi_host->hs_pos = 0;
+  p_midi_host->hs_cable = cable;
+  p_midi_host->hs_timeout_us = timeout_us;
+  p_midi_host->hs_held = false;
+  hs_send(p_midi_host, true);
+  return true;
+}
+
+bool tuh_midi_sysex_transfer_busy(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  return p_midi_host->hs_state != MIDIH_HS_IDLE;
+}
+
+void tuh_midi_sysex_transfer_abort(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->hs_state != MIDIH_HS_IDLE && p_midi_host->hs_state != MIDIH_HS_ENDING, );
+  if (p_midi_host->hs_state == MIDIH_HS_SENDING && p_midi_host->hs_pos != p_midi_host->hs_msg_start)
+    hs_end(p_midi_host);
+  else
+    hs_finish(p_midi_host, TUH_MIDI_SYSEX_XFER_ABORTED);
+}
+#endif
+
+#if CFG_MIDI_HOST_IDENTITY
+// Queue the Identity Request on as many of the remaining cables as fit
+// in the OUT FIFO. tuh_midi_task() sends the rest.
+static void id_send(midih_interface_t *p_midi_host)
+{
+  tu_fifo_t *tx_ff = get_tx_ff(p_midi_host);
+  bool sent = false;
+  while (p_midi_host->id_next_cable < p_midi_host->num_cables_tx && tu_fifo_remaining(tx_ff) >= 8)
+  {
+    uint8_t const cn = (uint8_t)(p_midi_host->id_next_cable++ << 4);
+    uint8_t const head[4] = {(uint8_t)(cn | MIDI_CIN_SYSEX_START), MIDI_STATUS_SYSEX_START, 0x7E, 0x7F};
+    uint8_t const tail[4] = {(uint8_t)(cn | MIDI_CIN_SYSEX_END_3BYTE), 0x06, 0x01, MIDI_STATUS_SYSEX_END};
+    tx_ff_write(p_midi_host, tx_ff, head);
+    tx_ff_write(p_midi_host, tx_ff, tail);
+    sent = true;
+  }
+  if (sent)
+  {
+    p_midi_host->id_sent_us = CFG_TUH_MIDI_TIME_US();
+    write_flush(p_midi_host->dev_addr, p_midi_host);
+  }
+}
+
+// Hold the first packet of what may be an Identity Reply
+static bool CFG_TUH_MIDI_HOT_FUNC(id_match_head)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  if ((buf[0] & 0xf) != MIDI_CIN_SYSEX_START || buf[1] != MIDI_STATUS_SYSEX_START || buf[2] != 0x7E)
+    return false;
+  memcpy(p_midi_host->id_head, buf, 4);
+  p_midi_host->id_cable = buf[0] >> 4;
+  p_midi_host->id_state = MIDIH_ID_HEAD;
+  return true;
+}
 
-      uint16_t const count = tu_fifo_write_n(&p_midi_host->tx_ff, stream->buffer, 4);
+// Keep the fields of a complete Identity Reply
+static void id_reply(midih_interface_t *p_midi_host)
+{
+  uint8_t const *reply = p_midi_host->id_bytes;
+  uint8_t const idx = reply[5] == 0 ? 8 : 6; // the byte after the manufacturer ID
+  ++p_midi_host->id_replies;
+  if (p_midi_host->id_valid || p_midi_host->id_len != idx + 9)
+    return;
+  tuh_midi_identity_t *identity = &p_midi_host->identity;
+  tu_memclr(identity, sizeof(*identity));
+  memcpy(identity->manufacturer, reply + 5, idx - 5u);
+  memcpy(identity->family, reply + idx, 2);
+  memcpy(identity->model, reply + idx + 2, 2);
+  memcpy(identity->version, reply + idx + 4, 4);
+  identity->device_id = reply[2];
+  identity->cable = p_midi_host->id_cable;
+  p_midi_host->id_valid = true;
+  if (tuh_midi_identity_cb)
+    tuh_midi_identity_cb(p_midi_host->dev_addr, identity);
+}
 
-      stream->index = 0;
+// Take the rest of an Identity Reply; id_head holds the first packet.
+// Returns false if buf shows it is not one.
+static bool CFG_TUH_MIDI_HOT_FUNC(id_match_tail)(midih_interface_t *p_midi_host, uint8_t const *buf)
+{
+  if (p_midi_host->id_state == MIDIH_ID_HEAD)
+  {
+    if ((buf[0] & 0xf) != MIDI_CIN_SYSEX_START || buf[1] != 0x06 || buf[2] != 0x02)
+      return false;
+    memcpy(p_midi_host->id_bytes, p_midi_host->id_head + 1, 3);
+    memcpy(p_midi_host->id_bytes + 3, buf + 1, 3);
+    p_midi_host->id_len = 6;
+    p_midi_host->id_state = MIDIH_ID_BODY;
+    return true;
+  }
+  for (uint8_t idx = 1; idx < 4; idx++)
+  {
+    uint8_t const data = buf[idx];
+    if (data > MIDI_MAX_DATA_VAL && data != MIDI_STATUS_SYSEX_END)
+      return false; // the reply was cut short
+    if (p_midi_host->id_len < sizeof(p_midi_host->id_bytes))
+      p_midi_host->id_bytes[p_midi_host->id_len] = data;
+    ++p_midi_host->id_len; // a reply that is too long does not match
+    if (data == MIDI_STATUS_SYSEX_END)
+    {
+      id_reply(p_midi_host);
+      p_midi_host->id_state = p_midi_host->id_replies < p_midi_host->num_cables_tx ? MIDIH_ID_WAITING : MIDIH_ID_IDLE;
+      return true;
+    }
+  }
+  return true;
+}
 
-      // FIFO overflown, since we already check fifo remaining. It is probably race condition
-      TU_ASSERT(count == 4, i);
+static void id_timeout(uint8_t dev_addr, midih_interface_t *p_midi_host, uint32_t now)
+{
+  if (p_midi_host->id_state == MIDIH_ID_IDLE)
+    return;
+  if (p_midi_host->id_next_cable < p_midi_host->num_cables_tx)
+  {
+    id_send(p_midi_host);
+  }
+  else if (now - p_midi_host->id_sent_us > CFG_TUH_MIDI_IDENTITY_TIMEOUT_US)
+  {
+    if (p_midi_host->id_state == MIDIH_ID_HEAD)
+    {
+      // nothing else will complete the held packet
+      if (rx_accept(p_midi_host, p_midi_host->id_head) && tuh_midi_rx_cb)
+        tuh_midi_rx_cb(dev_addr, 1);
     }
+    p_midi_host->id_state = MIDIH_ID_IDLE;
+    if (!p_midi_host->id_valid && tuh_midi_identity_cb)
+      tuh_midi_identity_cb(dev_addr, NULL);
   }
+}
 
-  return i;
+bool tuh_midi_get_identity(uint8_t dev_addr, tuh_midi_identity_t *identity)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->id_valid);
+  *identity = p_midi_host->identity;
+  return true;
 }
+#endif
 
+#if CFG_MIDI_HOST_TX_WATCHDOG
+bool tuh_midi_set_tx_timeout(uint8_t dev_addr, uint32_t timeout_us, uint8_t retries)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured);
+  p_midi_host->tx_timeout_us = timeout_us;
+  p_midi_host->tx_retries = retries;
+  return true;
+}
 
-bool tuh_midi_packet_write (uint8_t dev_addr, uint8_t const packet[4])
+uint32_t tuh_midi_tx_timeouts(uint8_t dev_addr)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
+  TU_VERIFY(p_midi_host != NULL, 0);
+  return p_midi_host->tx_timeouts;
+}
 
-  if (tu_fifo_remaining(&p_midi_host->tx_ff) < 4)
+// Drop everything waiting to be sent to the device. This only moves
+// the read side of each queue, so the producers can keep writing.
+static void tx_drain(midih_interface_t *p_midi_host)
+{
+  for (int producer = 0; producer < CFG_TUH_MIDI_TX_PRODUCERS; producer++)
   {
-    return false;
+    tu_fifo_t *tx_ff = &p_midi_host->tx_ff[producer];
+    uint16_t count = tu_fifo_count(tx_ff) & (uint16_t)~3u;
+    tu_fifo_advance_read_pointer(tx_ff, count);
+#if CFG_MIDI_HOST_TX_CANCEL
+    p_midi_host->tx_read[producer] += count/4;
+#endif
+#if CFG_MIDI_HOST_TX_MAX_AGE
+    uint16_t const entries = (uint16_t)(midih_limits.midi_tx_buf / 4);
+    p_midi_host->tx_ts_rd[producer] = (uint16_t)((p_midi_host->tx_ts_rd[producer] + count/4) % entries);
+#endif
   }
+#if CFG_MIDI_HOST_TX_REALTIME
+  p_midi_host->tx_rt_rd = p_midi_host->tx_rt_wr;
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+  p_midi_host->replaying = false;
+#endif
+}
 
-  tu_fifo_write_n(&p_midi_host->tx_ff, packet, 4);
+// Abort an OUT transfer the device has not taken in time, then send it
+// again or, after tx_retries tries, drop it and the rest of the OUT queue
+// so one stuck device cannot keep its writers waiting forever
+static void tx_watchdog(uint8_t dev_addr, midih_interface_t *p_midi_host, uint32_t now)
+{
+  if (p_midi_host->tx_timeout_us == 0 || !usbh_edpt_busy(dev_addr, p_midi_host->ep_out))
+    return;
+  if (now - p_midi_host->tx_xfer_us < p_midi_host->tx_timeout_us)
+    return;
+  TU_VERIFY(tuh_edpt_abort_xfer(dev_addr, p_midi_host->ep_out), );
+  ++p_midi_host->tx_timeouts;
+  bool const retry = p_midi_host->tx_retry_count < p_midi_host->tx_retries;
+  TU_LOG1("MIDI OUT transfer to dev_addr=%u timed out; %s\r\n", dev_addr, retry ? "retrying" : "dropping the OUT queue");
+  if (tuh_midi_tx_timeout_cb)
+    tuh_midi_tx_timeout_cb(dev_addr, retry);
+  if (retry)
+  {
+    uint8_t const retry_count = p_midi_host->tx_retry_count;
+    TU_VERIFY(usbh_edpt_claim(dev_addr, p_midi_host->ep_out), );
+    TU_ASSERT(usbh_edpt_xfer(dev_addr, p_midi_host->ep_out, p_midi_host->epout_buf, p_midi_host->tx_xfer_len), );
+    tx_watchdog_start(p_midi_host, p_midi_host->tx_xfer_len);
+    p_midi_host->tx_retry_count = (uint8_t)(retry_count + 1);
+  }
+  else
+  {
+    tx_drain(p_midi_host);
+  }
+}
+#endif
 
+#if CFG_MIDI_HOST_CLOCK_REGEN
+bool tuh_midi_clock_follow(uint8_t dev_addr, uint8_t cable, uint32_t delay_us)
+{
+  if (dev_addr != 0)
+  {
+    midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+    TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && cable < 16);
+  }
+  midih_clock.dev_addr = 0; // stop clock_input() while the state changes
+  midih_clock.cable = cable;
+  midih_clock.delay_us = delay_us;
+  midih_clock.have_input = false;
+  midih_clock.period_q8 = 0;
+  midih_clock.event_rd = midih_clock.event_wr;
+  midih_clock.dev_addr = dev_addr;
   return true;
 }
 
-uint32_t tuh_midi_stream_flush( uint8_t dev_addr )
+bool tuh_midi_clock_add_output(uint8_t dev_addr, uint8_t cable, uint8_t mul, uint8_t div)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
+  TU_VERIFY(p_midi_host != NULL && p_midi_host->configured && p_midi_host->ep_out != 0);
+  TU_VERIFY(cable < p_midi_host->num_cables_tx && mul != 0 && div != 0);
+  midih_clock_output_t *free_out = NULL;
+  for (int idx = 0; idx < CFG_MIDI_HOST_CLOCK_REGEN; idx++)
+  {
+    midih_clock_output_t *out = &midih_clock.out[idx];
+    if (out->dev_addr == dev_addr && out->cable == cable)
+    {
+      free_out = out;
+      break;
+    }
+    if (out->dev_addr == 0 && free_out == NULL)
+      free_out = out;
+  }
+  TU_VERIFY(free_out != NULL);
+  free_out->cable = cable;
+  free_out->mul = mul;
+  free_out->div = div;
+  free_out->div_count = 0;
+  free_out->sent = mul; // nothing to send until the next input clock
+  free_out->dev_addr = dev_addr;
+  return true;
+}
 
-  uint32_t bytes_flushed = 0;
-  if (!usbh_edpt_busy(p_midi_host->dev_addr, p_midi_host->ep_out))
+void tuh_midi_clock_remove_output(uint8_t dev_addr, uint8_t cable)
+{
+  for (int idx = 0; idx < CFG_MIDI_HOST_CLOCK_REGEN; idx++)
   {
-    bytes_flushed = write_flush(dev_addr, p_midi_host);
+    midih_clock_output_t *out = &midih_clock.out[idx];
+    if (out->dev_addr == dev_addr && out->cable == cable)
+      out->dev_addr = 0;
   }
-  return bytes_flushed;
 }
+
+uint32_t tuh_midi_clock_period_us(void)
+{
+  return midih_clock.period_q8 >> 8;
+}
+
+static void clock_device_closed(uint8_t dev_addr)
+{
+  if (midih_clock.dev_addr == dev_addr)
+    tuh_midi_clock_follow(0, 0, 0);
+  for (int idx = 0; idx < CFG_MIDI_HOST_CLOCK_REGEN; idx++)
+  {
+    if (midih_clock.out[idx].dev_addr == dev_addr)
+      midih_clock.out[idx].dev_addr = 0;
+  }
+}
+
+// Update the smoothed clock time and period with a clock that arrived at
+// now. This is an alpha-beta filter: the phase follows 1/4 of the error
+// and the period 1/32 of it, which is close to critically damped.
+static void clock_track(uint32_t now)
+{
+  uint32_t raw = now - midih_clock.in_last_us;
+  uint32_t period = midih_clock.period_q8 >> 8;
+  if (!midih_clock.have_input || raw > CFG_TUH_MIDI_CLOCK_TIMEOUT_US)
+  {
+    // the first clock, or the first after a pause
+    midih_clock.smooth_us = now;
+    midih_clock.period_q8 = 0;
+  }
+  else
+  {
+    int32_t err = (int32_t)(now - (midih_clock.smooth_us + period));
+    if (period == 0 || err > (int32_t)(period/2) || err < -(int32_t)(period/2))
+    {
+      // first period, tempo jump or lost clock; start again from the measured period
+      midih_clock.smooth_us = now;
+      midih_clock.period_q8 = raw << 8;
+    }
+    else
+    {
+      midih_clock.smooth_us += (uint32_t)((int32_t)period + err/4);
+      midih_clock.period_q8 = (uint32_t)((int32_t)midih_clock.period_q8 + err*8);
+    }
+  }
+  midih_clock.have_input = true;
+  midih_clock.in_last_us = now;
+}
+
+// Queue the clock and transport messages received from the input
+static void CFG_TUH_MIDI_HOT_FUNC(clock_input)(uint8_t const *buf)
+{
+  uint8_t const status = buf[1];
+  if (status != MIDI_STATUS_SYSREAL_TIMING_CLOCK && status != MIDI_STATUS_SYSREAL_START &&
+      status != MIDI_STATUS_SYSREAL_CONTINUE && status != MIDI_STATUS_SYSREAL_STOP &&
+      status != MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER)
+    return;
+  uint8_t wr = midih_clock.event_wr;
+  // If tuh_midi_task() is not keeping up, drop the event; the
+  // regenerator can recover from that but not from blocking here
+  TU_VERIFY((uint8_t)(wr - midih_clock.event_rd) < CFG_TUH_MIDI_CLOCK_EVENTS, );
+  uint32_t now = CFG_TUH_MIDI_TIME_US();
+  uint32_t due_us = now;
+  if (status == MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+  {
+    clock_track(now);
+    due_us = midih_clock.smooth_us;
+  }
+  due_us += midih_clock.delay_us;
+  // never earlier than it arrived
+  if ((int32_t)(due_us - now) < 0)
+    due_us = now;
+  uint8_t idx = wr % CFG_TUH_MIDI_CLOCK_EVENTS;
+  midih_clock.event[idx].due_us = due_us;
+  midih_clock.event[idx].status = status;
+  midih_clock.event[idx].data[0] = buf[2];
+  midih_clock.event[idx].data[1] = buf[3];
+  midih_clock.event_wr = (uint8_t)(wr + 1);
+}
+
+static bool clock_send(midih_clock_output_t *out, uint8_t cin, uint8_t status, uint8_t data0, uint8_t data1)
+{
+  uint8_t const packet[4] = {(uint8_t)((out->cable << 4) | cin), status, data0, data1};
+  return tuh_midi_packet_write_realtime(out->dev_addr, packet);
+}
+
+// Send an input event to one output
+static void clock_output_event(midih_clock_output_t *out, uint8_t status, uint8_t const data[2], uint32_t due_us)
+{
+  if (status == MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+  {
+    if (out->div_count == 0)
+    {
+      // Finish the last group so the output sends exactly
+      // mul clocks for every div input clocks. If the lane is full, the
+      // rest are dropped so the new group still starts on time.
+      for (; out->sent < out->mul; out->sent++)
+      {
+        if (!clock_send(out, MIDI_CIN_1BYTE_DATA, status, 0, 0))
+          break;
+      }
+      out->group_us = due_us;
+      out->sent = 0;
+    }
+    if (++out->div_count == out->div)
+      out->div_count = 0;
+    return;
+  }
+  // A start, continue or new position begins a new group
+  out->sent = out->mul;
+  if (status == MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER)
+  {
+    // Song position is in 16th notes, which are 6 input clocks
+    uint32_t pos = (uint32_t)data[0] | ((uint32_t)data[1] << 7);
+    out->div_count = (uint8_t)((pos * 6) % out->div);
+    pos = pos * out->mul / out->div;
+    if (pos > 0x3FFF)
+      pos = 0x3FFF;
+    clock_send(out, MIDI_CIN_SYSCOM_3BYTE, status, (uint8_t)(pos & 0x7f), (uint8_t)(pos >> 7));
+    return;
+  }
+  if (status == MIDI_STATUS_SYSREAL_START)
+    out->div_count = 0;
+  clock_send(out, MIDI_CIN_1BYTE_DATA, status, 0, 0);
+}
+
+static void clock_task(uint32_t now)
+{
+  while (midih_clock.event_rd != midih_clock.event_wr)
+  {
+    uint8_t rd = midih_clock.event_rd;
+    uint8_t idx = rd % CFG_TUH_MIDI_CLOCK_EVENTS;
+    if ((int32_t)(now - midih_clock.event[idx].due_us) < 0)
+      break;
+    for (int out = 0; out < CFG_MIDI_HOST_CLOCK_REGEN; out++)
+    {
+      if (midih_clock.out[out].dev_addr != 0)
+        clock_output_event(&midih_clock.out[out], midih_clock.event[idx].status, midih_clock.event[idx].data, midih_clock.event[idx].due_us);
+    }
+    midih_clock.event_rd = (uint8_t)(rd + 1);
+  }
+  // Send the clocks of each group as their times come. The first clock of a
+  // group is due at the start of the group and the others are spread
+  // evenly over div periods of the input clock.
+  uint32_t const period_q8 = midih_clock.period_q8;
+  for (int idx = 0; idx < CFG_MIDI_HOST_CLOCK_REGEN; idx++)
+  {
+    midih_clock_output_t *out = &midih_clock.out[idx];
+    while (out->dev_addr != 0 && out->sent < out->mul)
+    {
+      if (out->sent != 0)
+      {
+        if (period_q8 == 0)
+          break; // the rest are sent at the start of the next group
+        uint32_t offset = (uint32_t)(((uint64_t)out->sent * out->div * period_q8 / out->mul) >> 8);
+        if ((int32_t)(now - (out->group_us + offset)) < 0)
+          break;
+      }
+      if (!clock_send(out, MIDI_CIN_1BYTE_DATA, MIDI_STATUS_SYSREAL_TIMING_CLOCK, 0, 0))
+        break; // the lane is full; try again next time
+      ++out->sent;
+    }
+  }
+}
+#endif
+
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+// End the SysEx messages that got no new data for CFG_TUH_MIDI_SYSEX_TIMEOUT_US
+static void sysex_timeout(uint8_t dev_addr, midih_interface_t *p_midi_host, uint32_t now)
+{
+  // End a received message only after the application has read the packets
+  // that came before the timeout, so it reads them as part of the message
+  uint8_t one_byte;
+  bool rx_idle = !rx_peek_byte(p_midi_host, &one_byte);
+#if CFG_MIDI_HOST_RX_DEJITTER
+  rx_idle = rx_idle && p_midi_host->rx_jit_rd == p_midi_host->rx_jit_wr;
+#endif
+  for (uint8_t cable = 0; rx_idle && p_midi_host->rx_sysex_open >> cable; cable++)
+  {
+    uint16_t const cable_mask = (uint16_t)(1u << cable);
+    if (!(p_midi_host->rx_sysex_open & cable_mask) || (int32_t)(now - p_midi_host->rx_sysex_us[cable]) < CFG_TUH_MIDI_SYSEX_TIMEOUT_US)
+      continue;
+    p_midi_host->rx_sysex_open &= (uint16_t)~cable_mask;
+#if CFG_MIDI_HOST_STREAM_READ
+    p_midi_host->rx_sysex_in_progress &= (uint16_t)~cable_mask;
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+    p_midi_host->rx_checksum[cable].rule = p_midi_host->rx_checksum[cable].candidates = 0;
+#endif
+#endif
+    if (tuh_midi_sysex_timeout_cb)
+      tuh_midi_sysex_timeout_cb(dev_addr, cable, true);
+  }
+#if CFG_MIDI_HOST_STREAM_WRITE
+  // Only the streams of the producer calling this can be changed safely
+  if (p_midi_host->ep_out == 0)
+    return;
+  uint8_t const producer = CFG_TUH_MIDI_PRODUCER_ID();
+  tu_fifo_t *tx_ff = &p_midi_host->tx_ff[producer];
+  bool ended = false;
+  for (uint8_t cable = 0; cable < p_midi_host->num_cables_tx && cable < midih_limits.max_cables; cable++)
+  {
+    midi_stream_t *stream = &p_midi_host->stream_write[producer*midih_limits.max_cables + cable];
+    if ((stream->buffer[0] & 0xf) != MIDI_CIN_SYSEX_START)
+      continue;
+    if (!tu_fifo_empty(tx_ff))
+    {
+      stream->sysex_us = now; // waiting for the device is not a pause in the message
+      continue;
+    }
+    if ((int32_t)(now - stream->sysex_us) < CFG_TUH_MIDI_SYSEX_TIMEOUT_US)
+      continue;
+    // Send the buffered data bytes and F7 so the device ends the message too
+    uint8_t const pos = stream->index ? stream->index : 1;
+    stream->buffer[0] = (uint8_t)((cable << 4) | (MIDI_CIN_SYSEX_START + pos));
+    stream->buffer[pos] = MIDI_STATUS_SYSEX_END;
+    for (uint8_t idx = (uint8_t)(pos + 1); idx < 4; idx++) stream->buffer[idx] = 0;
+    tx_ff_write(p_midi_host, tx_ff, stream->buffer);
+    tu_memclr(stream, sizeof(midi_stream_t));
+    ended = true;
+    if (tuh_midi_sysex_timeout_cb)
+      tuh_midi_sysex_timeout_cb(dev_addr, cable, false);
+  }
+  if (ended)
+    tuh_midi_stream_flush(dev_addr);
+#endif
+}
+#endif
+
+void tuh_midi_task(void)
+{
+#ifdef CFG_TUH_MIDI_TIME_US
+  uint32_t now = CFG_TUH_MIDI_TIME_US();
+  for (uint8_t dev_addr = 1; dev_addr <= CFG_TUH_DEVICE_MAX; dev_addr++)
+  {
+    midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+    if (!p_midi_host->configured)
+      continue;
+#if CFG_MIDI_HOST_LATENCY_PROBE
+    latency_timeout(p_midi_host, now);
+#endif
+#if CFG_MIDI_HOST_RX_DEJITTER
+    uint32_t released = dejitter_release(p_midi_host, now);
+    if (released && tuh_midi_rx_cb)
+    {
+      tuh_midi_rx_cb(dev_addr, released);
+    }
+#endif
+#if CFG_MIDI_HOST_TX_WATCHDOG
+    if (p_midi_host->ep_out != 0)
+    {
+      tx_watchdog(dev_addr, p_midi_host, now);
+    }
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+    hs_timeout(dev_addr, p_midi_host, now);
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+    sysex_timeout(dev_addr, p_midi_host, now);
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+    id_timeout(dev_addr, p_midi_host, now);
+#endif
+#if CFG_MIDI_HOST_TX_SCHEDULE
+    if (p_midi_host->ep_out != 0)
+    {
+      schedule_release(dev_addr, p_midi_host, now);
+    }
+#endif
+  }
+#if CFG_MIDI_HOST_CLOCK_REGEN
+  clock_task(now);
+#endif
+  (void)now;
+#endif
+}
+
 //--------------------------------------------------------------------+
 // Helper
 //--------------------------------------------------------------------+
@@ -784,6 +3851,13 @@ uint8_t tuh_midih_get_num_tx_cables (uint8_t dev_addr)
   return p_midi_host->num_cables_tx;
 }
 
+uint8_t tuh_midi_get_rhport(uint8_t dev_addr)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, 0);
+  return p_midi_host->rhport;
+}
+
 uint8_t tuh_midih_get_num_rx_cables (uint8_t dev_addr)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
@@ -792,135 +3866,247 @@ uint8_t tuh_midih_get_num_rx_cables (uint8_t dev_addr)
   return p_midi_host->num_cables_rx;
 }
 
-bool tuh_midi_packet_read (uint8_t dev_addr, uint8_t packet[4])
+bool CFG_TUH_MIDI_HOT_FUNC(tuh_midi_packet_read)(uint8_t dev_addr, uint8_t packet[4])
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
   TU_VERIFY(p_midi_host != NULL);
-  TU_VERIFY(tu_fifo_count(&p_midi_host->rx_ff) >= 4);
-  return tu_fifo_read_n(&p_midi_host->rx_ff, packet, 4) == 4;
+  return rx_read_packet(p_midi_host, packet);
 }
 
-uint32_t tuh_midi_stream_read (uint8_t dev_addr, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize)
+uint32_t CFG_TUH_MIDI_HOT_FUNC(tuh_midi_packet_read_peek)(uint8_t dev_addr, uint8_t const **pp_packets)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
-  TU_VERIFY(p_midi_host != NULL);
-  uint32_t bytes_buffered = 0;
-  TU_ASSERT(p_cable_num);
-  TU_ASSERT(p_buffer);
-  TU_ASSERT(bufsize);
-  uint8_t one_byte;
-  if (!tu_fifo_peek(&p_midi_host->rx_ff, &one_byte))
+  TU_VERIFY(p_midi_host != NULL, 0);
+  tu_fifo_buffer_info_t info;
+  tu_fifo_get_read_info(&p_midi_host->rx_ff, &info);
+  if (info.len_lin != 0)
   {
-    return 0;
+    *pp_packets = info.ptr_lin;
+    return info.len_lin / 4;
+  }
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  midih_rx_segment_t *seg = rx_reserve_front(p_midi_host);
+  if (seg != NULL)
+  {
+    *pp_packets = seg->buf + seg->rd;
+    return (uint32_t)(seg->wr - seg->rd) / 4;
+  }
+#endif
+  return 0;
+}
+
+void CFG_TUH_MIDI_HOT_FUNC(tuh_midi_packet_read_advance)(uint8_t dev_addr, uint32_t num_packets)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL, );
+  // midih_xfer_cb() does not write to rx_ff while there are packets in
+  // the reserve, so the packets returned by tuh_midi_packet_read_peek()
+  // are still at the head of the same buffer
+  if (tu_fifo_count(&p_midi_host->rx_ff) != 0)
+  {
+    tu_fifo_advance_read_pointer(&p_midi_host->rx_ff, (uint16_t)(num_packets * 4));
+    return;
+  }
+#if CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+  midih_rx_segment_t *seg = rx_reserve_front(p_midi_host);
+  if (seg != NULL)
+  {
+    seg->rd += (uint16_t)(num_packets * 4);
+    rx_reserve_front(p_midi_host); // give the segment back now if it is empty
   }
-  *p_cable_num = (one_byte >> 4) & 0xf;
-  uint32_t nread = tu_fifo_read_n(&p_midi_host->rx_ff, p_midi_host->stream_read.buffer, 4);
-  static uint16_t cable_sysex_in_progress; // bit i is set if received MIDI_STATUS_SYSEX_START but not MIDI_STATUS_SYSEX_END
-  while (nread == 4 && bytes_buffered < bufsize)
+#endif
+}
+
+#if CFG_MIDI_HOST_STREAM_READ
+// Return the number of bytes of the MIDI stream the packet holds.
+// Bit n of *p_sysex_in_progress is set if cable n received
+// MIDI_STATUS_SYSEX_START but not MIDI_STATUS_SYSEX_END.
+static uint8_t CFG_TUH_MIDI_HOT_FUNC(decode_packet)(uint8_t const packet[4], uint16_t cable_mask, uint16_t *p_sysex_in_progress)
+{
+  uint8_t bytes_to_add_to_stream = 0;
+  // ignore the CIN field; too many devices out there encode this wrong
+  uint8_t status = packet[1];
+  if (status <= MIDI_MAX_DATA_VAL || status == MIDI_STATUS_SYSEX_START)
   {
-    *p_cable_num=(p_midi_host->stream_read.buffer[0] >> 4) & 0x0f;
-    uint8_t bytes_to_add_to_stream = 0;
-    if (*p_cable_num < p_midi_host->num_cables_rx)
+    if (status == MIDI_STATUS_SYSEX_START)
+    {
+      *p_sysex_in_progress |= cable_mask;
+    }
+    // only add the packet if a sysex message is in progress
+    if (*p_sysex_in_progress & cable_mask)
     {
-      // ignore the CIN field; too many devices out there encode this wrong
-      uint8_t status = p_midi_host->stream_read.buffer[1];
-      uint16_t cable_mask = (uint16_t) (1 << *p_cable_num);
-      if (status <= MIDI_MAX_DATA_VAL || status == MIDI_STATUS_SYSEX_START)
+      ++bytes_to_add_to_stream;
+      uint8_t idx;
+      for (idx = 2; idx < 4; idx++)
       {
-        if (status == MIDI_STATUS_SYSEX_START)
-        {
-          cable_sysex_in_progress |= cable_mask;
-        }
-        // only add the packet if a sysex message is in progress
-        if (cable_sysex_in_progress & cable_mask)
+        if (packet[idx] <= MIDI_MAX_DATA_VAL)
         {
           ++bytes_to_add_to_stream;
-          uint8_t idx;
-          for (idx = 2; idx < 4; idx++)
-          {
-            if (p_midi_host->stream_read.buffer[idx] <= MIDI_MAX_DATA_VAL)
-            {
-              ++bytes_to_add_to_stream;
-            }
-            else if (p_midi_host->stream_read.buffer[idx] == MIDI_STATUS_SYSEX_END)
-            {
-              ++bytes_to_add_to_stream;
-              cable_sysex_in_progress &= (uint16_t) ~cable_mask;
-              idx = 4; // force the loop to exit; I hate break statements in loops
-            }
-          }
-        }
-      }
-      else if (status < MIDI_STATUS_SYSEX_START)
-      {
-        // then it is a channel message either three bytes or two
-        uint8_t fake_cin = (status & 0xf0) >> 4;
-        switch (fake_cin)
-        {
-          case MIDI_CIN_NOTE_OFF:
-          case MIDI_CIN_NOTE_ON:
-          case MIDI_CIN_POLY_KEYPRESS:
-          case MIDI_CIN_CONTROL_CHANGE:
-          case MIDI_CIN_PITCH_BEND_CHANGE:
-            bytes_to_add_to_stream = 3;
-            break;
-          case MIDI_CIN_PROGRAM_CHANGE:
-          case MIDI_CIN_CHANNEL_PRESSURE:
-            bytes_to_add_to_stream = 2;
-            break;
-          default:
-            break; // Should not get this
         }
-        cable_sysex_in_progress &= (uint16_t)~cable_mask;
-      }
-      else if (status < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
-      {
-        switch (status)
+        else if (packet[idx] == MIDI_STATUS_SYSEX_END)
         {
-          case MIDI_STATUS_SYSCOM_TIME_CODE_QUARTER_FRAME:
-          case MIDI_STATUS_SYSCOM_SONG_SELECT:
-            bytes_to_add_to_stream = 2;
-            break;
-          case MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER:
-            bytes_to_add_to_stream = 3;
-            break;
-          case MIDI_STATUS_SYSCOM_TUNE_REQUEST:
-          case MIDI_STATUS_SYSEX_END:
-            bytes_to_add_to_stream = 1;
-            break;
-          default:
-            break;
-          cable_sysex_in_progress &= (uint16_t)~cable_mask;
+          ++bytes_to_add_to_stream;
+          *p_sysex_in_progress &= (uint16_t) ~cable_mask;
+          idx = 4; // force the loop to exit; I hate break statements in loops
         }
       }
-      else
-      {
-        // Real-time message: can be inserted into a sysex message,
-        // so do don't clear cable_sysex_in_progress bit
+    }
+  }
+  else if (status < MIDI_STATUS_SYSEX_START)
+  {
+    // then it is a channel message either three bytes or two
+    uint8_t fake_cin = (status & 0xf0) >> 4;
+    switch (fake_cin)
+    {
+      case MIDI_CIN_NOTE_OFF:
+      case MIDI_CIN_NOTE_ON:
+      case MIDI_CIN_POLY_KEYPRESS:
+      case MIDI_CIN_CONTROL_CHANGE:
+      case MIDI_CIN_PITCH_BEND_CHANGE:
+        bytes_to_add_to_stream = 3;
+        break;
+      case MIDI_CIN_PROGRAM_CHANGE:
+      case MIDI_CIN_CHANNEL_PRESSURE:
+        bytes_to_add_to_stream = 2;
+        break;
+      default:
+        break; // Should not get this
+    }
+    *p_sysex_in_progress &= (uint16_t)~cable_mask;
+  }
+  else if (status < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+  {
+    switch (status)
+    {
+      case MIDI_STATUS_SYSCOM_TIME_CODE_QUARTER_FRAME:
+      case MIDI_STATUS_SYSCOM_SONG_SELECT:
+        bytes_to_add_to_stream = 2;
+        break;
+      case MIDI_STATUS_SYSCOM_SONG_POSITION_POINTER:
+        bytes_to_add_to_stream = 3;
+        break;
+      case MIDI_STATUS_SYSCOM_TUNE_REQUEST:
+      case MIDI_STATUS_SYSEX_END:
         bytes_to_add_to_stream = 1;
-      }
+        break;
+      default:
+        break;
+      *p_sysex_in_progress &= (uint16_t)~cable_mask;
     }
-    uint8_t idx;
-    for (idx = 1; idx <= bytes_to_add_to_stream; idx++)
+  }
+  else
+  {
+    // Real-time message: can be inserted into a sysex message,
+    // so do don't clear cable_sysex_in_progress bit
+    bytes_to_add_to_stream = 1;
+  }
+  return bytes_to_add_to_stream;
+}
+
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+// Run the received bytes of the stream through the checksum of the cable
+static void checksum_rx(midih_interface_t *p_midi_host, uint8_t cable_num, uint8_t const *bytes, uint8_t nbytes)
+{
+  midih_checksum_t *acc = &p_midi_host->rx_checksum[cable_num];
+  for (; nbytes; nbytes--)
+  {
+    uint8_t const one_byte = *bytes++;
+    if (one_byte <= MIDI_MAX_DATA_VAL)
     {
-      *p_buffer++ = p_midi_host->stream_read.buffer[idx];
+      checksum_data(acc, one_byte);
     }
-    bytes_buffered += bytes_to_add_to_stream;
-    nread = 0;
-    if (tu_fifo_peek(&p_midi_host->rx_ff, &one_byte))
+    else if (one_byte == MIDI_STATUS_SYSEX_START)
+    {
+      checksum_start(acc, false);
+    }
+    else if (one_byte == MIDI_STATUS_SYSEX_END)
     {
-      uint8_t new_cable = (one_byte >> 4) & 0xf;
-      if (new_cable == *p_cable_num)
+      acc->result = TUH_MIDI_CHECKSUM_NONE;
+      if (acc->rule)
       {
-        // still on the same cable. Continue reading the stream
-        nread = tu_fifo_read_n(&p_midi_host->rx_ff, p_midi_host->stream_read.buffer, 4);
+        // the last data byte is the checksum of the ones before it
+        uint8_t const type = midih_checksum_rules[acc->rule - 1].type;
+        uint8_t const sum = type == TUH_MIDI_CHECKSUM_XOR ? (uint8_t)(acc->sum ^ acc->last) : (uint8_t)(acc->sum - acc->last);
+        acc->result = acc->has_data && checksum_value(type, sum) == acc->last ? TUH_MIDI_CHECKSUM_OK : TUH_MIDI_CHECKSUM_BAD;
+        if (acc->result == TUH_MIDI_CHECKSUM_BAD && tuh_midi_checksum_error_cb)
+          tuh_midi_checksum_error_cb(p_midi_host->dev_addr, cable_num);
       }
+      acc->rule = acc->candidates = 0;
     }
+    else if (one_byte < MIDI_STATUS_SYSREAL_TIMING_CLOCK)
+    {
+      acc->rule = acc->candidates = 0; // the message ended without F7
+    }
+  }
+}
+
+uint8_t tuh_midi_checksum_result(uint8_t dev_addr, uint8_t cable)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL && cable < 16, TUH_MIDI_CHECKSUM_NONE);
+  return p_midi_host->rx_checksum[cable].result;
+}
+#endif
+
+// Stream read for devices with a single IN cable. rx_queue_single() sets the
+// cable number of every packet to 0, so there is no need to check it here.
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(stream_read_single)(midih_interface_t *p_midi_host, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize)
+{
+  uint32_t bytes_buffered = 0;
+  uint8_t *packet = p_midi_host->stream_read.buffer;
+  *p_cable_num = 0;
+  // a packet can hold up to 3 bytes of the stream
+  while (bufsize - bytes_buffered >= 3 && rx_read_packet(p_midi_host, packet))
+  {
+    uint8_t bytes_to_add_to_stream = decode_packet(packet, 1, &p_midi_host->rx_sysex_in_progress);
+    memcpy(p_buffer + bytes_buffered, packet + 1, bytes_to_add_to_stream);
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+    checksum_rx(p_midi_host, 0, packet + 1, bytes_to_add_to_stream);
+#endif
+    bytes_buffered += bytes_to_add_to_stream;
   }
+  return bytes_buffered;
+}
 
+// Stream read for devices with multiple IN cables. Read packets until
+// the cable number changes.
+static uint32_t CFG_TUH_MIDI_HOT_FUNC(stream_read_multi)(midih_interface_t *p_midi_host, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize)
+{
+  uint32_t bytes_buffered = 0;
+  uint8_t *packet = p_midi_host->stream_read.buffer;
+  uint8_t one_byte;
+  if (!rx_peek_byte(p_midi_host, &one_byte))
+  {
+    return 0;
+  }
+  uint8_t const cable_num = (one_byte >> 4) & 0xf;
+  uint16_t const cable_mask = (uint16_t) (1 << cable_num);
+  *p_cable_num = cable_num;
+  // a packet can hold up to 3 bytes of the stream
+  while (bufsize - bytes_buffered >= 3 && rx_peek_byte(p_midi_host, &one_byte) && ((one_byte >> 4) & 0xf) == cable_num)
+  {
+    rx_read_packet(p_midi_host, packet);
+    uint8_t bytes_to_add_to_stream = decode_packet(packet, cable_mask, &p_midi_host->rx_sysex_in_progress);
+    memcpy(p_buffer + bytes_buffered, packet + 1, bytes_to_add_to_stream);
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+    checksum_rx(p_midi_host, cable_num, packet + 1, bytes_to_add_to_stream);
+#endif
+    bytes_buffered += bytes_to_add_to_stream;
+  }
   return bytes_buffered;
 }
 
+uint32_t CFG_TUH_MIDI_HOT_FUNC(tuh_midi_stream_read)(uint8_t dev_addr, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize)
+{
+  midih_interface_t *p_midi_host = get_midi_host(dev_addr);
+  TU_VERIFY(p_midi_host != NULL);
+  TU_ASSERT(p_cable_num);
+  TU_ASSERT(p_buffer);
+  TU_ASSERT(bufsize);
+  return p_midi_host->ops->stream_read(p_midi_host, p_cable_num, p_buffer, bufsize);
+}
+#endif
+
 uint8_t tuh_midi_get_num_rx_cables(uint8_t dev_addr)
 {
   midih_interface_t *p_midi_host = get_midi_host(dev_addr);
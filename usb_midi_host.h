@@ -62,6 +62,8 @@
 // To send long SysEx messages, you should make this buffer at least as
 // long as the longest message in MIDI packets or else SysEx message
 // writes may get truncated.
+// If CFG_TUH_MIDI_TX_PRODUCERS is greater than 1, each producer gets
+// its own buffer of this size.
 //
 // max_cables defaults to 16. If you know you only need to convert
 // serial MIDI data to USB MIDI packets from cable numbers 0:N,
@@ -82,6 +84,215 @@ void tuh_midih_define_limits(size_t midi_rx_buffer_bytes, size_t midi_tx_buffer_
 #endif
 #endif
 
+// Set CFG_MIDI_HOST_DEVICE_KEY to 1 to compute a device key that
+// stays the same when the device is unplugged and plugged in again.
+// Enabling this makes the driver read the device's serial number string
+// before it calls tuh_midi_mount_cb().
+#ifndef CFG_MIDI_HOST_DEVICE_KEY
+#define CFG_MIDI_HOST_DEVICE_KEY 0
+#endif
+
+// Set CFG_MIDI_HOST_STATE_CHASE to 1 to make the driver remember the
+// last Bank Select, Program Change, Control Change and Pitch Bend values
+// written to each channel of the first CFG_MIDI_HOST_STATE_CHASE_CABLES
+// OUT cables of a device, so they can be sent again after the device
+// is re-plugged. The state is kept per device key, so this requires
+// CFG_MIDI_HOST_DEVICE_KEY. Each cable costs about 2.4 kBytes of RAM
+// per device. If CFG_MIDI_HOST_STATE_CHASE_AUTO is 1, the driver
+// replays the state as soon as a known device is configured again.
+#ifndef CFG_MIDI_HOST_STATE_CHASE
+#define CFG_MIDI_HOST_STATE_CHASE 0
+#endif
+#if CFG_MIDI_HOST_STATE_CHASE
+#if !CFG_MIDI_HOST_DEVICE_KEY
+#error "CFG_MIDI_HOST_STATE_CHASE requires CFG_MIDI_HOST_DEVICE_KEY"
+#endif
+#ifndef CFG_MIDI_HOST_STATE_CHASE_CABLES
+#define CFG_MIDI_HOST_STATE_CHASE_CABLES 1
+#endif
+#ifndef CFG_MIDI_HOST_STATE_CHASE_AUTO
+#define CFG_MIDI_HOST_STATE_CHASE_AUTO 1
+#endif
+#endif
+
+// Set CFG_MIDI_HOST_RX_RESERVE_SEGMENTS to the number of segments in an
+// RX reserve shared by all devices. When a device's RX buffer is full,
+// the driver queues the packets that do not fit in segments it borrows
+// from the reserve, and gives each segment back as soon as the
+// application has read it. This way you can keep midi_rx_buffer_bytes in
+// tuh_midih_define_limits() small and still receive a long SysEx message
+// from any one device. Each segment holds CFG_MIDI_HOST_RX_SEGMENT_BYTES
+// bytes. A segment is closed at the end of each transfer, so there is
+// little point in making it longer than the IN endpoint packet size.
+#ifndef CFG_MIDI_HOST_RX_RESERVE_SEGMENTS
+#define CFG_MIDI_HOST_RX_RESERVE_SEGMENTS 0
+#endif
+#ifndef CFG_MIDI_HOST_RX_SEGMENT_BYTES
+#define CFG_MIDI_HOST_RX_SEGMENT_BYTES 64
+#endif
+
+// Set CFG_MIDI_HOST_TX_SCHEDULE to the number of OUT packets per device
+// that can wait for their due time after tuh_midi_packet_write_at().
+// The schedule runs on the driver timebase. On the RP2040 that is
+// time_us_32(); on other processors, define CFG_TUH_MIDI_TIME_US() in
+// your config file to return a free running 32-bit microsecond count.
+#ifndef CFG_MIDI_HOST_TX_SCHEDULE
+#define CFG_MIDI_HOST_TX_SCHEDULE 0
+#endif
+
+// Set CFG_MIDI_HOST_RX_TAP to a power of 2 to keep a copy of every
+// received packet, with the driver time it arrived, in a ring of that many
+// entries. Consumers like the Standard MIDI File recorder read the copies
+// with tuh_midi_rx_tap_read(); the application still reads the packets as
+// usual. The tap needs the driver timebase; see CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_RX_TAP
+#define CFG_MIDI_HOST_RX_TAP 0
+#endif
+
+// Set CFG_MIDI_HOST_RX_DEJITTER to a power of 2 to give each device a
+// buffer of that many packets that can hold received packets for a fixed
+// time after they arrive, so the application sees them with a constant
+// delay instead of the varying delay of USB polling and hubs. It needs the
+// driver timebase; see CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_RX_DEJITTER
+#define CFG_MIDI_HOST_RX_DEJITTER 0
+#endif
+
+// Set CFG_MIDI_HOST_LATENCY_PROBE to 1 to measure the round trip time
+// through devices that echo what they receive, e.g. a device in MIDI thru
+// mode or with a loopback cable. It needs the driver timebase; see
+// CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_LATENCY_PROBE
+#define CFG_MIDI_HOST_LATENCY_PROBE 0
+#endif
+
+// Set CFG_MIDI_HOST_RX_SHED to 1 to drop the received packets that matter
+// least first when a device's RX buffer is nearly full, instead of dropping
+// whatever arrives once it is full, and to count dropped packets by class.
+#ifndef CFG_MIDI_HOST_RX_SHED
+#define CFG_MIDI_HOST_RX_SHED 0
+#endif
+
+// Set CFG_MIDI_HOST_TX_MAX_AGE to 1 to record when each OUT packet was
+// queued, so packets that waited too long, e.g. while a device stalled,
+// can be dropped instead of sent late. It needs the driver timebase; see
+// CFG_MIDI_HOST_TX_SCHEDULE. It costs 4 bytes of RAM per queued packet.
+#ifndef CFG_MIDI_HOST_TX_MAX_AGE
+#define CFG_MIDI_HOST_TX_MAX_AGE 0
+#endif
+
+// Set CFG_MIDI_HOST_TX_CANCEL to 1 to add tuh_midi_tx_cancel(), which
+// drops the packets queued for some cables of a device. It makes the
+// driver copy OUT packets one at a time, which costs a little speed.
+#ifndef CFG_MIDI_HOST_TX_CANCEL
+#define CFG_MIDI_HOST_TX_CANCEL 0
+#endif
+
+// Set CFG_MIDI_HOST_TX_WATCHDOG to 1 to make tuh_midi_task() abort OUT
+// transfers a device does not take in time, so a device that stops
+// reading cannot block the OUT queue forever. It needs the driver
+// timebase; see CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_TX_WATCHDOG
+#define CFG_MIDI_HOST_TX_WATCHDOG 0
+#endif
+
+// Set CFG_MIDI_HOST_TX_REALTIME to a power of 2 up to 128 to give each
+// device a realtime OUT lane of that many packets. Packets written with
+// tuh_midi_packet_write_realtime() go out in the next OUT transfer ahead
+// of everything in the OUT queue, so clock and transport messages do not
+// wait behind long SysEx messages.
+#ifndef CFG_MIDI_HOST_TX_REALTIME
+#define CFG_MIDI_HOST_TX_REALTIME 0
+#endif
+
+// Set CFG_MIDI_HOST_CLOCK_REGEN to the number of outputs of a MIDI clock
+// regenerator. The regenerator locks a steady clock to the MIDI clock
+// received on one cable of one device and sends it, optionally multiplied
+// or divided, to each output through the realtime lane. It also forwards
+// Start, Stop, Continue and Song Position Pointer. It needs
+// CFG_MIDI_HOST_TX_REALTIME and the driver timebase; see
+// CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_CLOCK_REGEN
+#define CFG_MIDI_HOST_CLOCK_REGEN 0
+#endif
+#if CFG_MIDI_HOST_CLOCK_REGEN && !CFG_MIDI_HOST_TX_REALTIME
+#error "CFG_MIDI_HOST_CLOCK_REGEN requires CFG_MIDI_HOST_TX_REALTIME"
+#endif
+
+// Set CFG_MIDI_HOST_RX_STATE to 1 to make the driver keep the current
+// controller state of each channel of the first CFG_MIDI_HOST_RX_STATE_CABLES
+// IN cables of a device as packets arrive: the value of every Control
+// Change, Pitch Bend, Channel Pressure, Program, Poly Pressure and which
+// notes are held. The application can read it with the tuh_midi_state_*()
+// queries without reading the RX queue. Each cable costs about 4.4 kBytes
+// of RAM per device.
+#ifndef CFG_MIDI_HOST_RX_STATE
+#define CFG_MIDI_HOST_RX_STATE 0
+#endif
+#ifndef CFG_MIDI_HOST_RX_STATE_CABLES
+#define CFG_MIDI_HOST_RX_STATE_CABLES 1
+#endif
+
+// Set CFG_MIDI_HOST_SYSEX_HANDSHAKE to 1 to add tuh_midi_sysex_transfer(),
+// which sends a series of SysEx messages one at a time and waits for the
+// receiver to answer each one with ACK, NAK, WAIT or CANCEL, as in the
+// MIDI Sample Dump Standard and File Dump protocols. It needs the driver
+// timebase; see CFG_MIDI_HOST_TX_SCHEDULE.
+#ifndef CFG_MIDI_HOST_SYSEX_HANDSHAKE
+#define CFG_MIDI_HOST_SYSEX_HANDSHAKE 0
+#endif
+
+// Set CFG_MIDI_HOST_SYSEX_CHECKSUM to the number of SysEx checksum rules,
+// up to 8. Each rule gives a SysEx header and a checksum type. The driver
+// verifies the checksum of matching messages read with
+// tuh_midi_stream_read() and inserts the checksum before the F7 of
+// matching messages written with tuh_midi_stream_write().
+#ifndef CFG_MIDI_HOST_SYSEX_CHECKSUM
+#define CFG_MIDI_HOST_SYSEX_CHECKSUM 0
+#endif
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM > 8
+#error "CFG_MIDI_HOST_SYSEX_CHECKSUM must be 8 or less"
+#endif
+
+// Set CFG_MIDI_HOST_SYSEX_TIMEOUT to 1 to end a SysEx message that gets
+// no new data on its cable for CFG_TUH_MIDI_SYSEX_TIMEOUT_US, such as
+// when a device drops packets. tuh_midi_task() then resets the SysEx state
+// of the cable, so later data bytes are not taken as part of the message,
+// and invokes tuh_midi_sysex_timeout_cb(). Requires CFG_TUH_MIDI_TIME_US().
+#ifndef CFG_MIDI_HOST_SYSEX_TIMEOUT
+#define CFG_MIDI_HOST_SYSEX_TIMEOUT 0
+#endif
+
+// Set CFG_MIDI_HOST_IDENTITY to 1 to send a Universal Identity Request on
+// every OUT cable of each device when it is mounted and keep the Identity
+// Reply. See tuh_midi_get_identity(). Requires CFG_TUH_MIDI_TIME_US().
+#ifndef CFG_MIDI_HOST_IDENTITY
+#define CFG_MIDI_HOST_IDENTITY 0
+#endif
+
+// The following switches remove driver features the application does not
+// use to save flash and RAM. They all default to 1.
+// Set CFG_MIDI_HOST_STREAM_WRITE to 0 if the application only sends
+// packets with tuh_midi_packet_write(). This removes tuh_midi_stream_write()
+// and its per-cable encoder state.
+#ifndef CFG_MIDI_HOST_STREAM_WRITE
+#define CFG_MIDI_HOST_STREAM_WRITE 1
+#endif
+
+// Set CFG_MIDI_HOST_STREAM_READ to 0 if the application only receives
+// packets with tuh_midi_packet_read(). This removes tuh_midi_stream_read()
+// and its decoder state.
+#ifndef CFG_MIDI_HOST_STREAM_READ
+#define CFG_MIDI_HOST_STREAM_READ 1
+#endif
+
+// Set CFG_MIDI_HOST_ZLP to 0 if no attached device needs a zero length
+// packet after an OUT transfer that is a multiple of the endpoint size.
+// Leave it set unless you know all your devices.
+#ifndef CFG_MIDI_HOST_ZLP
+#define CFG_MIDI_HOST_ZLP 1
+#endif
+
 //--------------------------------------------------------------------+
 // Application API (Single Interface)
 //--------------------------------------------------------------------+
@@ -103,11 +314,13 @@ uint8_t tuh_midih_get_num_rx_cables (uint8_t dev_addr);
 // Returns true if the packet was successfully queued.
 bool tuh_midi_packet_write (uint8_t dev_addr, uint8_t const packet[4]);
 
+#if CFG_MIDI_HOST_STREAM_WRITE
 // Queue a message to the device. The application
 // must call tuh_midi_stream_flush to actually have the
 // data go out. Note that cable_num must be < CFG_TUH_CABLE_MAX
 // (note CFG_TUH_CABLE_MAX default is 16)
 uint32_t tuh_midi_stream_write (uint8_t dev_addr, uint8_t cable_num, uint8_t const* p_buffer, uint32_t bufsize);
+#endif
 
 /// Return true if the MIDI OUT FIFO has enough space for at
 /// least one more message
@@ -118,20 +331,50 @@ bool tuh_midi_can_write_stream (uint8_t dev_addr);
 // the host hardware is busy or there is nothing in queue to send.
 uint32_t tuh_midi_stream_flush( uint8_t dev_addr);
 
+// Return the root port the device is attached to, directly or through
+// hubs. The TinyUSB host stack assigns dev_addr values that are unique
+// across all root ports, so every other function in this API works the
+// same no matter which root port the device is on.
+uint8_t tuh_midi_get_rhport(uint8_t dev_addr);
+
+// Call tuh_midi_stream_flush() for every configured device on root port
+// rhport. This lets the application service each root port from its own
+// loop; e.g. the native USB host port and a Pico-PIO-USB host port.
+// Returns the total number of bytes flushed to the host hardware.
+uint32_t tuh_midi_stream_flush_rhport(uint8_t rhport);
+
+#if CFG_MIDI_HOST_STREAM_READ
 // Get the MIDI stream from the device. Set the value pointed
 // to by p_cable_num to the MIDI cable number intended to receive it.
 // The MIDI stream will be stored in the buffer pointed to by p_buffer.
-// Return the number of bytes added to the buffer.
+// Return the number of bytes added to the buffer. A packet can add up
+// to 3 bytes to the buffer, so bufsize should be at least 3.
 // Note that this function ignores the CIN field of the MIDI packet
 // because a number of commercial devices out there do not encode
 // it properly.
 uint32_t tuh_midi_stream_read (uint8_t dev_addr, uint8_t *p_cable_num, uint8_t *p_buffer, uint16_t bufsize);
+#endif
 
 // Read a raw MIDI packet from the connected device
 // This function does not parse the packet format
 // Return true if a packet was returned
 bool tuh_midi_packet_read (uint8_t dev_addr, uint8_t packet[4]);
 
+// Read received packets in place without copying them. Set *pp_packets
+// to point to the oldest received packet and return the number of
+// 4-byte packets that follow it in one contiguous block of memory, or 0 if
+// there are no packets. The block stays valid until the application calls
+// tuh_midi_packet_read_advance(). More packets may be waiting after the
+// block; call this function again after the advance to get them.
+// Do not mix these calls with other read calls for the same device
+// between a peek and its advance.
+uint32_t tuh_midi_packet_read_peek (uint8_t dev_addr, uint8_t const **pp_packets);
+
+// Discard num_packets packets from the block returned by the
+// previous call to tuh_midi_packet_read_peek(). num_packets must
+// not be more than the number that function returned.
+void tuh_midi_packet_read_advance (uint8_t dev_addr, uint32_t num_packets);
+
 uint8_t tuh_midi_get_num_rx_cables(uint8_t dev_addr);
 uint8_t tuh_midi_get_num_tx_cables(uint8_t dev_addr);
 #if CFG_MIDI_HOST_DEVSTRINGS
@@ -139,6 +382,373 @@ uint8_t tuh_midi_get_rx_cable_istrings(uint8_t dev_addr, uint8_t* istrings, uint
 uint8_t tuh_midi_get_tx_cable_istrings(uint8_t dev_addr, uint8_t* istrings, uint8_t max_istrings);
 uint8_t tuh_midi_get_all_istrings(uint8_t dev_addr, const uint8_t** istrings);
 #endif
+
+#if CFG_MIDI_HOST_DEVICE_KEY
+// Return a non-zero key that identifies the device independent of
+// its dev_addr, or 0 if the device is not configured. The key is a hash
+// of the device VID, PID, serial number string and the hub port path from
+// the root port, so the same device plugged into the same port gets the
+// same key every time it is enumerated. The key is valid from the time
+// tuh_midi_mount_cb() is called.
+uint32_t tuh_midi_get_device_key(uint8_t dev_addr);
+
+// Return the dev_addr of the configured device with the given key,
+// or 0 if no such device is currently mounted.
+uint8_t tuh_midi_find_device(uint32_t device_key);
+#endif
+
+#if CFG_MIDI_HOST_STATE_CHASE
+// Queue the Bank Select, Program Change, Control Change and Pitch Bend
+// messages needed to restore the last values written to the device.
+// Only values that were actually written are sent, and Bank Select is
+// always sent before Program Change. Data Entry, RPN/NRPN and Channel Mode
+// controllers are not replayed. The driver keeps the OUT queue topped up
+// and sends the messages in full size transfers until all are sent.
+// Returns false if there is nothing to replay or a replay is in progress.
+bool tuh_midi_state_replay(uint8_t dev_addr);
+
+// Forget the remembered state of the device
+void tuh_midi_state_clear(uint8_t dev_addr);
+#endif
+#if defined(CFG_TUH_MIDI_TIME_US) || TU_CHECK_MCU(OPT_MCU_RP2040)
+// Return the driver timebase in microseconds. It wraps around about every
+// 71 minutes, so compare two times by the sign of their difference cast
+// to int32_t. Only available if the driver has a timebase; see
+// CFG_MIDI_HOST_TX_SCHEDULE.
+uint32_t tuh_midi_time_us(void);
+#endif
+
+// Run the driver features that need to run on time, such as the OUT
+// schedule. Call this from the application main loop as often as possible.
+void tuh_midi_task(void);
+
+#if CFG_MIDI_HOST_TX_SCHEDULE
+// Queue a packet to be sent to the device when tuh_midi_time_us()
+// reaches due_us. Packets with the same due time are sent in the order
+// they were queued. tuh_midi_task() moves due packets to the OUT queue and
+// flushes it, so call this function and tuh_midi_task() from the same thread.
+// Returns false if the schedule of the device is full.
+bool tuh_midi_packet_write_at(uint8_t dev_addr, uint8_t const packet[4], uint32_t due_us);
+
+// Return the number of packets that can still be added to the
+// schedule of the device
+uint32_t tuh_midi_schedule_available(uint8_t dev_addr);
+
+// Set the output latency of the device in microseconds. The schedule
+// sends every packet to the device this much earlier than its due time, so
+// events from one timeline reach devices with different latencies at the
+// same moment. The per-cable offset set by tuh_midi_set_tx_cable_offset()
+// adds to this one. The offsets are cleared when the device is unplugged;
+// set them again in tuh_midi_mount_cb(), e.g. from a table of measured values.
+bool tuh_midi_set_tx_offset(uint8_t dev_addr, int32_t offset_us);
+
+// Set the output latency of one cable of the device in microseconds
+bool tuh_midi_set_tx_cable_offset(uint8_t dev_addr, uint8_t cable, int32_t offset_us);
+
+// Return the total output latency offset for cable of the device
+int32_t tuh_midi_get_tx_offset(uint8_t dev_addr, uint8_t cable);
+#endif
+
+#if CFG_MIDI_HOST_RX_DEJITTER
+// Hold each packet received from the device for delay_us after it arrives
+// before the application can read it. tuh_midi_task() releases the packets
+// and calls tuh_midi_rx_cb(), so call tuh_midi_task() from the same thread
+// as tuh_task(). If the buffer fills, the oldest packet is released early.
+// Set delay_us to 0 to turn the buffer off; packets still in it are
+// released right away. The delay is cleared when the device is unplugged.
+bool tuh_midi_set_rx_dejitter(uint8_t dev_addr, uint32_t delay_us);
+
+// Return the number of packets released early because the buffer was full
+uint32_t tuh_midi_get_rx_dejitter_early(uint8_t dev_addr);
+#endif
+
+#if CFG_MIDI_HOST_RX_SHED
+// Classes of received packets for load shedding
+enum
+{
+  TUH_MIDI_CLASS_REALTIME = 0,   // real time messages except Active Sensing
+  TUH_MIDI_CLASS_NOTE,           // Note On and Note Off
+  TUH_MIDI_CLASS_SYSTEM,         // SysEx and system common messages
+  TUH_MIDI_CLASS_CONTROL,        // Control Change and Program Change
+  TUH_MIDI_CLASS_PITCH_BEND,
+  TUH_MIDI_CLASS_AFTERTOUCH,     // Polyphonic Key Pressure and Channel Pressure
+  TUH_MIDI_CLASS_ACTIVE_SENSING,
+  TUH_MIDI_NUM_CLASSES
+};
+
+// Drop received packets of class cls when less than level/16 of a
+// device's RX buffer space, including the RX reserve, is free. Level 0
+// means packets of the class are only dropped when there is no room at
+// all. The defaults are 0 for real time, note and system messages, 2 for
+// controls, 3 for pitch bend, 4 for aftertouch and 6 for Active Sensing.
+// Shedding SysEx packets leaves broken messages, so leave its level at 0.
+// Returns false if cls or level is out of range.
+bool tuh_midi_rx_shed_set(uint8_t cls, uint8_t level);
+
+// Return the number of packets of class cls received from the device
+// but dropped, either shed or because there was no room
+uint32_t tuh_midi_rx_dropped(uint8_t dev_addr, uint8_t cls);
+#endif
+
+#if CFG_MIDI_HOST_TX_MAX_AGE
+// Drop OUT packets to the device that waited in the OUT queue longer than
+// max_age_us instead of sending them. Only Note On (velocity not 0),
+// Control Change (except Channel Mode messages and controllers 64 to 69
+// with a value below 64), Program Change, pressure and Pitch Bend packets
+// are dropped; Note Off, SysEx and system messages are always sent.
+// 0 means no limit. The limits are cleared when the device is unplugged.
+bool tuh_midi_set_tx_max_age(uint8_t dev_addr, uint32_t max_age_us);
+
+// Set the maximum age for one cable of the device. If it is not 0,
+// it is used instead of the limit for the whole device.
+bool tuh_midi_set_tx_cable_max_age(uint8_t dev_addr, uint8_t cable, uint32_t max_age_us);
+
+// Return the number of OUT packets dropped because they were too old
+uint32_t tuh_midi_tx_expired(uint8_t dev_addr);
+#endif
+
+#if CFG_MIDI_HOST_TX_WATCHDOG
+// Set the OUT transfer watchdog of the device. If an OUT transfer does not
+// complete within timeout_us, tuh_midi_task() aborts it, calls
+// tuh_midi_tx_timeout_cb() and sends it again, up to retries times. After
+// that it drops the transfer and everything in the OUT queue of the device.
+// Only set retries above 0 if the host controller driver implements
+// hcd_edpt_abort_xfer(); otherwise the retry is sent to an endpoint that
+// still has the old transfer. A timeout_us of 0 turns the watchdog off.
+// When a device is configured, the watchdog is set to
+// CFG_TUH_MIDI_TX_TIMEOUT_US (0.5 seconds) and CFG_TUH_MIDI_TX_RETRIES
+// (0); change it in tuh_midi_mount_cb().
+bool tuh_midi_set_tx_timeout(uint8_t dev_addr, uint32_t timeout_us, uint8_t retries);
+
+// Return the number of OUT transfers to the device that timed out
+uint32_t tuh_midi_tx_timeouts(uint8_t dev_addr);
+#endif
+
+#if CFG_MIDI_HOST_RX_TAP
+typedef struct
+{
+  uint32_t time_us;   // tuh_midi_time_us() when the packet arrived
+  uint8_t dev_addr;
+  uint8_t packet[4];
+} tuh_midi_rx_event_t;
+
+// Start or stop copying received packets to the RX tap. Starting
+// discards copies that were not read and clears the dropped count.
+void tuh_midi_rx_tap_enable(bool enable);
+
+// Get the oldest copy from the RX tap. Returns false if there is none.
+// Call this from one thread only.
+bool tuh_midi_rx_tap_read(tuh_midi_rx_event_t *event);
+
+// Return the number of packets not copied because the RX tap was full
+uint32_t tuh_midi_rx_tap_dropped(void);
+#endif
+
+#if CFG_MIDI_HOST_TX_CANCEL
+// Drop the packets queued to the device for the cables in cable_mask
+// (bit n for cable n) and start sending whatever is left. If that cuts a
+// SysEx message short, the driver sends a SysEx end (F7) on the cable
+// before anything else written to it, so the device does not wait for the
+// rest of the message. It also forgets the partial message in the
+// tuh_midi_stream_write() encoder of the caller for those cables and drops
+// their packets from the OUT schedule. Packets written after this call
+// are sent as usual. Call this function from the thread that writes to
+// these cables.
+bool tuh_midi_tx_cancel(uint8_t dev_addr, uint16_t cable_mask);
+#endif
+
+#if CFG_MIDI_HOST_TX_REALTIME
+// Queue a packet in the realtime lane of the device and start sending it
+// if the OUT endpoint is idle. The packet goes out ahead of all packets in
+// the OUT queue. Use this for short messages only, such as clock and
+// transport messages. Call this function from one thread only; if the
+// clock regenerator is on, that is the thread that calls tuh_midi_task().
+// Returns false if the lane is full.
+bool tuh_midi_packet_write_realtime(uint8_t dev_addr, uint8_t const packet[4]);
+#endif
+
+#if CFG_MIDI_HOST_CLOCK_REGEN
+// Follow the MIDI clock received on cable of the device at dev_addr, or
+// stop following if dev_addr is 0. The regenerator smooths the time of
+// each received clock and sends the clock to the outputs delay_us after
+// that time, or when it arrives if it arrives later, so the outputs get
+// a clock with a constant delay and much less jitter. Choose delay_us a
+// little longer than the jitter of the input. Start, Stop, Continue and
+// Song Position Pointer messages are forwarded with the same delay and
+// in order with the clock. The application still receives everything.
+// tuh_midi_task() sends the clock, so call it from the same thread as
+// tuh_task(). The input is cleared when the device is unplugged.
+bool tuh_midi_clock_follow(uint8_t dev_addr, uint8_t cable, uint32_t delay_us);
+
+// Send the regenerated clock to cable of the device at dev_addr at mul/div
+// times the input clock rate; e.g. mul 1 and div 2 halves the rate.
+// Song Position Pointer values are scaled the same way. If the output is
+// already in use, this changes its rate. The output is removed when the
+// device is unplugged. Returns false if all outputs are in use.
+bool tuh_midi_clock_add_output(uint8_t dev_addr, uint8_t cable, uint8_t mul, uint8_t div);
+
+// Stop sending the regenerated clock to cable of the device at dev_addr
+void tuh_midi_clock_remove_output(uint8_t dev_addr, uint8_t cable);
+
+// Return the smoothed period of the input clock in microseconds,
+// or 0 if the regenerator has not measured it yet
+uint32_t tuh_midi_clock_period_us(void);
+#endif
+
+#if CFG_MIDI_HOST_RX_STATE
+// The value received last on channel chan (0-15) of cable of the device
+// at dev_addr. The 7-bit queries return 0xFF and tuh_midi_state_pitch_bend()
+// returns 0xFFFF if the device has not sent the value since it was
+// mounted or the cable is not mirrored. Reset All Controllers and the
+// Channel Mode messages update the state the way the MIDI specification
+// says a receiver should. The state is updated when a packet arrives, so
+// it can be ahead of the packets still in the RX queue.
+uint8_t tuh_midi_state_cc(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t cc);
+uint16_t tuh_midi_state_pitch_bend(uint8_t dev_addr, uint8_t cable, uint8_t chan);
+uint8_t tuh_midi_state_channel_pressure(uint8_t dev_addr, uint8_t cable, uint8_t chan);
+uint8_t tuh_midi_state_program(uint8_t dev_addr, uint8_t cable, uint8_t chan);
+uint8_t tuh_midi_state_poly_pressure(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t note);
+
+// Return true if the device has sent a Note On for note on channel chan
+// of cable without a Note Off since
+bool tuh_midi_state_note_held(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t note);
+
+// Copy the held notes of channel chan of cable to notes; bit (n%8) of
+// notes[n/8] is set if note n is held. Returns false if the cable is not
+// mirrored.
+bool tuh_midi_state_notes_held(uint8_t dev_addr, uint8_t cable, uint8_t chan, uint8_t notes[16]);
+#endif
+
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+// Results of a handshake SysEx transfer; see tuh_midi_sysex_transfer_cb()
+enum
+{
+  TUH_MIDI_SYSEX_XFER_DONE,       // all messages were sent
+  TUH_MIDI_SYSEX_XFER_CANCELLED,  // the receiver sent CANCEL
+  TUH_MIDI_SYSEX_XFER_FAILED,     // the receiver sent NAK too many times in a row
+  TUH_MIDI_SYSEX_XFER_ABORTED,    // the application stopped it or the device was unplugged
+};
+
+// Send the len bytes at data, which must be one or more complete SysEx
+// messages back to back, on cable of the device at dev_addr. The driver
+// sends one message, then waits for the handshake reply
+// (F0 7E <channel> 7C..7F <packet> F7) on the same cable before it sends
+// the next one. It handles the reply in the IN transfer callback, so the
+// next message goes out as soon as the receiver is ready, and the reply
+// does not reach the application. ACK sends the next message, NAK sends
+// the same message again, WAIT waits for another reply and CANCEL stops
+// the transfer. If no reply arrives within timeout_us of sending a
+// message, the driver assumes the receiver does not handshake and sends
+// the next message; set timeout_us to 0 to wait forever. The data must
+// stay valid until tuh_midi_sysex_transfer_cb() is called. Call this
+// function from the same thread as tuh_task(), and call tuh_midi_task()
+// from that thread too. Returns false if a transfer to the device is
+// already in progress.
+bool tuh_midi_sysex_transfer(uint8_t dev_addr, uint8_t cable, uint8_t const *data, uint32_t len, uint32_t timeout_us);
+
+// Return true while a handshake SysEx transfer to the device is in progress
+bool tuh_midi_sysex_transfer_busy(uint8_t dev_addr);
+
+// Stop the handshake SysEx transfer to the device. If a message was only
+// partly queued, the driver ends it with F7; if the OUT queue is full, it
+// does so when there is room, and the transfer stays busy until then.
+// tuh_midi_sysex_transfer_cb() reports TUH_MIDI_SYSEX_XFER_ABORTED once
+// the F7 is queued.
+void tuh_midi_sysex_transfer_abort(uint8_t dev_addr);
+#endif
+
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+// Checksum types. The checksum is one data byte just before F7 and
+// covers the data bytes between the header and the checksum.
+enum
+{
+  TUH_MIDI_CHECKSUM_ROLAND,  // 128 minus the sum of the bytes, modulo 128
+  TUH_MIDI_CHECKSUM_XOR,     // exclusive OR of the bytes
+  TUH_MIDI_CHECKSUM_SUM,     // sum of the bytes, modulo 128
+};
+
+// Results of tuh_midi_checksum_result()
+enum
+{
+  TUH_MIDI_CHECKSUM_NONE,    // the message did not match a rule
+  TUH_MIDI_CHECKSUM_OK,
+  TUH_MIDI_CHECKSUM_BAD,
+};
+
+// A header byte that matches any data byte, such as a device ID
+#define TUH_MIDI_CHECKSUM_ANY 0x80
+#define TUH_MIDI_CHECKSUM_HEADER_MAX 8
+
+typedef struct
+{
+  uint8_t header[TUH_MIDI_CHECKSUM_HEADER_MAX]; // the data bytes after F0
+  uint8_t header_len;   // 0 turns the rule off
+  uint8_t type;         // one of the TUH_MIDI_CHECKSUM_* types
+  bool verify_rx;       // check received messages
+  bool insert_tx;       // add the checksum to sent messages
+} tuh_midi_checksum_rule_t;
+
+// Set checksum rule idx (0 to CFG_MIDI_HOST_SYSEX_CHECKSUM-1) for all
+// devices. If several rules match a message, the one with the shortest
+// header wins. For example, Roland Data Set 1 messages to a model with ID
+// 0x42 from any device ID are
+//   {{0x41, TUH_MIDI_CHECKSUM_ANY, 0x42, 0x12}, 4, TUH_MIDI_CHECKSUM_ROLAND, true, true}
+// Change the rules only when no SysEx message is being read or written.
+bool tuh_midi_set_checksum_rule(uint8_t idx, tuh_midi_checksum_rule_t const *rule);
+
+// Return the TUH_MIDI_CHECKSUM_* result for the last SysEx message
+// tuh_midi_stream_read() returned from cable of the device at dev_addr.
+// It is valid once tuh_midi_stream_read() has returned the F7.
+uint8_t tuh_midi_checksum_result(uint8_t dev_addr, uint8_t cable);
+#endif
+
+#if CFG_MIDI_HOST_IDENTITY
+// The fields of an Identity Reply (F0 7E <device ID> 06 02 ... F7) as sent
+typedef struct
+{
+  uint8_t manufacturer[3]; // a one byte ID is in manufacturer[0]; a three byte ID starts with 0x00
+  uint8_t family[2];       // least significant byte first
+  uint8_t model[2];        // least significant byte first
+  uint8_t version[4];
+  uint8_t device_id;       // the SysEx device ID of the reply
+  uint8_t cable;           // the IN cable the reply came on
+} tuh_midi_identity_t;
+
+// Copy the Identity Reply of the device at dev_addr to identity. The
+// driver sends F0 7E 7F 06 01 F7 on each OUT cable when the device is
+// mounted and keeps the first reply. Identity Replies that arrive within
+// CFG_TUH_MIDI_IDENTITY_TIMEOUT_US of the last request do not reach the
+// application. Returns false if the device has not replied.
+bool tuh_midi_get_identity(uint8_t dev_addr, tuh_midi_identity_t *identity);
+#endif
+
+#if CFG_MIDI_HOST_LATENCY_PROBE
+typedef struct
+{
+  uint32_t count;   // number of probes that came back
+  uint32_t lost;    // number of probes that did not come back in time
+  uint32_t min_us;
+  uint32_t max_us;
+  uint32_t last_us;
+  uint64_t sum_us;  // divide by count for the mean
+} tuh_midi_latency_stats_t;
+
+// Send a latency probe on cable of the device. If sysex is true, the probe
+// is the SysEx message F0 7D 4C <2 sequence bytes> F7; otherwise it is a
+// Note On and Note Off on MIDI channel 16, note 0. The driver consumes the
+// echo of the probe in the IN transfer callback, so the application never
+// reads it, and adds the round trip time to the device statistics.
+// The OUT queue must be empty, so the time in the queue does not count.
+// Returns false if a probe is still pending or the OUT queue is not empty.
+bool tuh_midi_latency_probe(uint8_t dev_addr, uint8_t cable, bool sysex);
+
+// Copy the round trip time statistics of the device to *stats
+bool tuh_midi_latency_get_stats(uint8_t dev_addr, tuh_midi_latency_stats_t *stats);
+
+// Clear the round trip time statistics of the device
+void tuh_midi_latency_reset(uint8_t dev_addr);
+#endif
+
 //--------------------------------------------------------------------+
 // Internal Class Driver API
 //--------------------------------------------------------------------+
@@ -165,6 +775,38 @@ TU_ATTR_WEAK void tuh_midi_umount_cb(uint8_t dev_addr, uint8_t instance);
 
 TU_ATTR_WEAK void tuh_midi_rx_cb(uint8_t dev_addr, uint32_t num_packets);
 TU_ATTR_WEAK void tuh_midi_tx_cb(uint8_t dev_addr);
+#if CFG_MIDI_HOST_TX_WATCHDOG
+// Invoked from tuh_midi_task() when an OUT transfer to the device timed out.
+// If retrying is false, the driver dropped the OUT queue of the device.
+TU_ATTR_WEAK void tuh_midi_tx_timeout_cb(uint8_t dev_addr, bool retrying);
+#endif
+#if CFG_MIDI_HOST_SYSEX_HANDSHAKE
+// Invoked when a handshake SysEx transfer ends. result is one of the
+// TUH_MIDI_SYSEX_XFER_* values and bytes_sent is the number of bytes of
+// data the receiver accepted.
+TU_ATTR_WEAK void tuh_midi_sysex_transfer_cb(uint8_t dev_addr, uint8_t result, uint32_t bytes_sent);
+#endif
+#if CFG_MIDI_HOST_SYSEX_CHECKSUM
+// Invoked from tuh_midi_stream_read() when a received SysEx message that
+// matches a checksum rule has a bad checksum
+TU_ATTR_WEAK void tuh_midi_checksum_error_cb(uint8_t dev_addr, uint8_t cable);
+#endif
+#if CFG_MIDI_HOST_SYSEX_TIMEOUT
+// Invoked from tuh_midi_task() when it ends a SysEx message that timed out
+// on cable. received is true for a message from the device; the driver
+// forgets the rest of it. received is false for a message written with
+// tuh_midi_stream_write(); the driver sends F7 to end it.
+TU_ATTR_WEAK void tuh_midi_sysex_timeout_cb(uint8_t dev_addr, uint8_t cable, bool received);
+#endif
+#if CFG_MIDI_HOST_IDENTITY
+// Invoked when the first Identity Reply of the device arrives, or from
+// tuh_midi_task() with identity NULL if no reply arrived in time
+TU_ATTR_WEAK void tuh_midi_identity_cb(uint8_t dev_addr, tuh_midi_identity_t const *identity);
+#endif
+#if CFG_MIDI_HOST_LATENCY_PROBE
+// Invoked from the IN transfer callback when the echo of a latency probe arrives
+TU_ATTR_WEAK void tuh_midi_latency_cb(uint8_t dev_addr, uint32_t rtt_us);
+#endif
 #ifdef __cplusplus
 }
 #endif
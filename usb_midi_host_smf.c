@@ -0,0 +1,447 @@
+/* 
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "tusb_option.h"
+
+#if (TUSB_OPT_HOST_ENABLED)
+
+#include "usb_midi_host_smf.h"
+#include <string.h>
+
+#if CFG_MIDI_HOST_TX_SCHEDULE
+//--------------------------------------------------------------------+
+// Track parser
+//--------------------------------------------------------------------+
+static uint32_t read_be(uint8_t const *p, uint8_t nbytes)
+{
+  uint32_t val = 0;
+  while (nbytes--)
+  {
+    val = (val << 8) | *p++;
+  }
+  return val;
+}
+
+// Read a variable length quantity. Return false if the track ends first.
+static bool read_vlq(tuh_midi_smf_track_t *track, uint32_t *p_val)
+{
+  uint32_t val = 0;
+  for (int idx = 0; idx < 4; idx++)
+  {
+    if (track->next >= track->end)
+      return false;
+    uint8_t one_byte = *track->next++;
+    val = (val << 7) | (one_byte & 0x7f);
+    if ((one_byte & 0x80) == 0)
+    {
+      *p_val = val;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parse the next event of the track. Set track->status to 0 if
+// the track has ended or the rest of the track is not valid.
+static void track_next(tuh_midi_smf_track_t *track)
+{
+  uint32_t delta;
+  track->status = 0;
+  if (!read_vlq(track, &delta) || track->next >= track->end)
+    return;
+  uint8_t status = *track->next;
+  if (status & 0x80)
+    ++track->next;
+  else
+    status = track->running_status;
+  if (status >= 0x80 && status < 0xF0)
+  {
+    uint8_t ndata = ((status & 0xE0) == 0xC0) ? 1 : 2; // program change and channel pressure have 1
+    if (track->end - track->next < ndata)
+      return;
+    track->data[0] = track->next[0];
+    track->data[1] = (ndata == 2) ? track->next[1] : 0;
+    track->next += ndata;
+    track->running_status = status;
+  }
+  else if (status == 0xF0 || status == 0xF7 || status == 0xFF)
+  {
+    if (status == 0xFF)
+    {
+      if (track->next >= track->end)
+        return;
+      track->meta_type = *track->next++;
+    }
+    // SysEx and meta events cancel running status
+    track->running_status = 0;
+    uint32_t len;
+    if (!read_vlq(track, &len) || len > (uint32_t)(track->end - track->next))
+      return;
+    track->bytes = track->next;
+    track->len = len;
+    track->next += len;
+    if (status == 0xFF && track->meta_type == 0x2F)
+      return; // End of Track
+  }
+  else
+  {
+    return;
+  }
+  track->tick += delta;
+  track->status = status;
+}
+
+//--------------------------------------------------------------------+
+// Player
+//--------------------------------------------------------------------+
+// Return the time of tick in microseconds from tick 0
+static uint64_t tick_to_us(tuh_midi_smf_player_t const *player, uint32_t tick)
+{
+  if (player->division > 0)
+  {
+    return player->tempo_us + (uint64_t)(tick - player->tempo_tick) * player->tempo / (uint16_t)player->division;
+  }
+  // SMPTE time: the upper byte is minus the frame rate, where 29 means
+  // 29.97 frames per second, and the lower byte is ticks per frame
+  uint32_t fps = (uint32_t)(-(int8_t)((uint16_t)player->division >> 8));
+  uint32_t tpf = (uint16_t)player->division & 0xff;
+  if (fps == 29)
+  {
+    return (uint64_t)tick * 100000000u / (2997u * tpf);
+  }
+  return (uint64_t)tick * 1000000u / (fps * tpf);
+}
+
+static bool send_packet(tuh_midi_smf_player_t *player, uint32_t due_us, uint8_t cin, uint8_t const *bytes, uint8_t nbytes)
+{
+  uint8_t packet[4] = {(uint8_t)((player->cable << 4) | cin), 0, 0, 0};
+  memcpy(packet + 1, bytes, nbytes);
+  return tuh_midi_packet_write_at(player->dev_addr, packet, due_us);
+}
+
+// Schedule as many packets of the pending SysEx or escape event as fit.
+// Return true when the whole event is scheduled.
+static bool schedule_sysex(tuh_midi_smf_player_t *player, tuh_midi_smf_track_t const *track, uint32_t due_us)
+{
+  // A SysEx event is F0 followed by the event data. An escape event
+  // is just the event data, e.g. a SysEx continuation or a real time message.
+  uint32_t prefix = (track->status == 0xF0) ? 1 : 0;
+  uint32_t total = track->len + prefix;
+  while (player->sysex_sent < total)
+  {
+    uint8_t bytes[3];
+    uint8_t nbytes = 0;
+    bool sysex_end = false;
+    while (nbytes < 3 && !sysex_end && player->sysex_sent + nbytes < total)
+    {
+      uint32_t idx = player->sysex_sent + nbytes;
+      bytes[nbytes] = (idx < prefix) ? 0xF0 : track->bytes[idx - prefix];
+      sysex_end = (bytes[nbytes] == 0xF7);
+      ++nbytes;
+    }
+    uint8_t cin;
+    if (sysex_end)
+    {
+      cin = (uint8_t)(MIDI_CIN_SYSEX_END_1BYTE + nbytes - 1);
+    }
+    else if (nbytes == 3)
+    {
+      cin = MIDI_CIN_SYSEX_START;
+    }
+    else
+    {
+      // An event that is not a whole number of packets and does not end
+      // the SysEx message; send the rest one byte at a time
+      cin = MIDI_CIN_1BYTE_DATA;
+      nbytes = 1;
+    }
+    if (!send_packet(player, due_us, cin, bytes, nbytes))
+      return false;
+    player->sysex_sent += nbytes;
+  }
+  player->sysex_sent = 0;
+  return true;
+}
+
+// Schedule the pending event of the track.
+// Return false if the device schedule is full.
+static bool schedule_event(tuh_midi_smf_player_t *player, tuh_midi_smf_track_t const *track, uint32_t due_us)
+{
+  uint8_t status = track->status;
+  if (status < 0xF0)
+  {
+    uint8_t bytes[3] = {status, track->data[0], track->data[1]};
+    return send_packet(player, due_us, status >> 4, bytes, 3);
+  }
+  if (status == 0xFF)
+  {
+    if (track->meta_type == 0x51 && track->len == 3 && player->division > 0)
+    {
+      // Set Tempo
+      player->tempo_us = tick_to_us(player, track->tick);
+      player->tempo_tick = track->tick;
+      player->tempo = read_be(track->bytes, 3);
+    }
+    return true;
+  }
+  return schedule_sysex(player, track, due_us);
+}
+
+bool tuh_midi_smf_open(tuh_midi_smf_player_t *player, uint8_t const *smf, uint32_t len)
+{
+  TU_VERIFY(player != NULL && smf != NULL);
+  tu_memclr(player, sizeof(*player));
+  TU_VERIFY(len >= 14 && memcmp(smf, "MThd", 4) == 0);
+  uint32_t header_len = read_be(smf + 4, 4);
+  TU_VERIFY(header_len >= 6 && header_len <= len - 8);
+  uint32_t format = read_be(smf + 8, 2);
+  TU_VERIFY(format <= 1); // type 2 files hold independent sequences
+  player->division = (int16_t)read_be(smf + 12, 2);
+  if (player->division < 0)
+  {
+    int8_t fps = (int8_t)(-(int8_t)((uint16_t)player->division >> 8));
+    TU_VERIFY((fps == 24 || fps == 25 || fps == 29 || fps == 30) && (player->division & 0xff) != 0);
+  }
+  TU_VERIFY(player->division != 0);
+
+  uint8_t const *end = smf + len;
+  uint8_t const *chunk = smf + 8 + header_len;
+  while (end - chunk >= 8)
+  {
+    uint8_t const *data = chunk + 8;
+    uint32_t chunk_len = read_be(chunk + 4, 4);
+    if (chunk_len > (uint32_t)(end - data))
+      chunk_len = (uint32_t)(end - data); // truncated file; play what is there
+    if (memcmp(chunk, "MTrk", 4) == 0)
+    {
+      TU_VERIFY(player->num_tracks < CFG_MIDI_HOST_SMF_MAX_TRACKS);
+      tuh_midi_smf_track_t *track = &player->track[player->num_tracks++];
+      track->next = data;
+      track->end = data + chunk_len;
+      track_next(track);
+    }
+    chunk = data + chunk_len;
+  }
+  TU_VERIFY(player->num_tracks > 0);
+  player->tempo = 500000; // 120 beats per minute until the first Set Tempo event
+  return true;
+}
+
+void tuh_midi_smf_play(tuh_midi_smf_player_t *player, uint8_t dev_addr, uint8_t cable, uint32_t start_us)
+{
+  player->dev_addr = dev_addr;
+  player->cable = cable;
+  player->start_us = start_us;
+  player->playing = true;
+}
+
+void tuh_midi_smf_stop(tuh_midi_smf_player_t *player)
+{
+  player->playing = false;
+}
+
+bool tuh_midi_smf_task(tuh_midi_smf_player_t *player)
+{
+  TU_VERIFY(player->playing);
+  if (!tuh_midi_configured(player->dev_addr))
+  {
+    player->playing = false;
+    return false;
+  }
+  uint32_t horizon = tuh_midi_time_us() + CFG_MIDI_HOST_SMF_LOOKAHEAD_US;
+  for (;;)
+  {
+    // Merge the tracks: the earliest pending event goes next. If two
+    // events have the same time, the one in the lower numbered track goes first.
+    tuh_midi_smf_track_t *next = NULL;
+    for (uint8_t idx = 0; idx < player->num_tracks; idx++)
+    {
+      tuh_midi_smf_track_t *track = &player->track[idx];
+      if (track->status != 0 && (next == NULL || track->tick < next->tick))
+        next = track;
+    }
+    if (next == NULL)
+    {
+      player->playing = false;
+      return false;
+    }
+    uint32_t due_us = player->start_us + (uint32_t)tick_to_us(player, next->tick);
+    if ((int32_t)(due_us - horizon) > 0)
+      return true;
+    if (!schedule_event(player, next, due_us))
+      return true; // the device schedule is full; try again later
+    track_next(next);
+  }
+}
+#endif
+
+#if CFG_MIDI_HOST_RX_TAP
+//--------------------------------------------------------------------+
+// Recorder
+//--------------------------------------------------------------------+
+#define SMF_TRACK_LEN_OFFSET 18
+#define SMF_TRACK_DATA_OFFSET 22
+
+static bool flush_block(tuh_midi_smf_recorder_t *recorder)
+{
+  if (recorder->block_len == 0)
+    return true;
+  if (!recorder->sink(recorder->context, recorder->offset, recorder->block, recorder->block_len))
+  {
+    recorder->recording = false;
+    return false;
+  }
+  recorder->offset += recorder->block_len;
+  recorder->block_len = 0;
+  return true;
+}
+
+static bool emit(tuh_midi_smf_recorder_t *recorder, uint8_t const *data, uint32_t len)
+{
+  while (len)
+  {
+    uint32_t nbytes = tu_min32(len, CFG_MIDI_HOST_SMF_BLOCK_BYTES - recorder->block_len);
+    memcpy(recorder->block + recorder->block_len, data, nbytes);
+    recorder->block_len += nbytes;
+    data += nbytes;
+    len -= nbytes;
+    if (recorder->block_len == CFG_MIDI_HOST_SMF_BLOCK_BYTES && !flush_block(recorder))
+      return false;
+  }
+  return true;
+}
+
+// Write a variable length quantity
+static bool emit_vlq(tuh_midi_smf_recorder_t *recorder, uint32_t val)
+{
+  uint8_t bytes[4];
+  uint8_t idx = sizeof(bytes);
+  val &= 0x0FFFFFFF;
+  bytes[--idx] = val & 0x7f;
+  while (val >>= 7)
+  {
+    bytes[--idx] = (uint8_t)(0x80 | (val & 0x7f));
+  }
+  return emit(recorder, bytes + idx, sizeof(bytes) - idx);
+}
+
+// Write a SysEx (F0) or escape (F7) event with len data bytes
+static bool emit_sysex(tuh_midi_smf_recorder_t *recorder, uint8_t type, uint8_t const *data, uint8_t len)
+{
+  recorder->running_status = 0; // SysEx events cancel running status
+  return emit(recorder, &type, 1) && emit_vlq(recorder, len) && emit(recorder, data, len);
+}
+
+// Write the event in the packet if the file format can hold it
+static bool record_packet(tuh_midi_smf_recorder_t *recorder, uint32_t time_us, uint8_t const packet[4])
+{
+  uint8_t const cin = packet[0] & 0xf;
+  uint8_t const *bytes = packet + 1;
+  uint8_t const status = bytes[0];
+  bool channel_msg = status >= 0x80 && status < 0xF0;
+  bool sysex = cin >= MIDI_CIN_SYSEX_START && cin <= MIDI_CIN_SYSEX_END_3BYTE &&
+      (recorder->in_sysex || status == 0xF0);
+  if (!channel_msg && !sysex)
+    return true;
+
+  // Go by the time since the last event, so the 32-bit clock can wrap
+  recorder->rem_us += (uint32_t)(time_us - recorder->last_us);
+  recorder->last_us = time_us;
+  uint32_t delta = recorder->rem_us / 1000;
+  recorder->rem_us -= delta * 1000;
+  TU_VERIFY(emit_vlq(recorder, delta));
+
+  if (channel_msg)
+  {
+    // Look at the status byte, not the CIN; see decode_packet()
+    uint8_t ndata = ((status & 0xE0) == 0xC0) ? 1 : 2;
+    if (status != recorder->running_status)
+    {
+      TU_VERIFY(emit(recorder, &status, 1));
+      recorder->running_status = status;
+    }
+    return emit(recorder, bytes + 1, ndata);
+  }
+  // Each packet of a SysEx message becomes its own event. The first is an
+  // F0 event without the F7, and the rest are F7 escape events.
+  uint8_t nbytes = (cin == MIDI_CIN_SYSEX_START) ? 3 : (uint8_t)(cin - MIDI_CIN_SYSEX_START);
+  recorder->in_sysex = (cin == MIDI_CIN_SYSEX_START);
+  if (status == 0xF0)
+    return emit_sysex(recorder, 0xF0, bytes + 1, nbytes - 1);
+  return emit_sysex(recorder, 0xF7, bytes, nbytes);
+}
+
+bool tuh_midi_smf_record_start(tuh_midi_smf_recorder_t *recorder, tuh_midi_smf_sink_t sink, void *context, uint8_t dev_addr, uint8_t cable)
+{
+  static const uint8_t header[SMF_TRACK_DATA_OFFSET] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,
+    0, 0,         // type 0
+    0, 1,         // 1 track
+    0xE7, 40,     // 25 frames per second, 40 ticks per frame
+    'M', 'T', 'r', 'k', 0, 0, 0, 0 // the length is written when recording stops
+  };
+  TU_VERIFY(recorder != NULL && sink != NULL);
+  tu_memclr(recorder, sizeof(*recorder));
+  recorder->sink = sink;
+  recorder->context = context;
+  recorder->dev_addr = dev_addr;
+  recorder->cable = cable;
+  recorder->recording = true;
+  TU_VERIFY(emit(recorder, header, sizeof(header)));
+  recorder->last_us = tuh_midi_time_us();
+  tuh_midi_rx_tap_enable(true);
+  return true;
+}
+
+bool tuh_midi_smf_record_task(tuh_midi_smf_recorder_t *recorder)
+{
+  TU_VERIFY(recorder->recording);
+  tuh_midi_rx_event_t event;
+  while (tuh_midi_rx_tap_read(&event))
+  {
+    if (event.dev_addr == recorder->dev_addr && (event.packet[0] >> 4) == recorder->cable)
+    {
+      TU_VERIFY(record_packet(recorder, event.time_us, event.packet));
+    }
+  }
+  return true;
+}
+
+uint32_t tuh_midi_smf_record_stop(tuh_midi_smf_recorder_t *recorder)
+{
+  static const uint8_t end_of_track[] = {0, 0xFF, 0x2F, 0};
+  bool recorded = tuh_midi_smf_record_task(recorder);
+  tuh_midi_rx_tap_enable(false);
+  TU_VERIFY(recorded, 0);
+  TU_VERIFY(emit(recorder, end_of_track, sizeof(end_of_track)) && flush_block(recorder), 0);
+  recorder->recording = false;
+  uint32_t file_len = recorder->offset;
+  uint32_t track_len = file_len - SMF_TRACK_DATA_OFFSET;
+  uint8_t len_bytes[4] = {(uint8_t)(track_len >> 24), (uint8_t)(track_len >> 16), (uint8_t)(track_len >> 8), (uint8_t)track_len};
+  TU_VERIFY(recorder->sink(recorder->context, SMF_TRACK_LEN_OFFSET, len_bytes, sizeof(len_bytes)), 0);
+  return file_len;
+}
+#endif
+#endif
@@ -0,0 +1,169 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef _TUSB_MIDI_HOST_SMF_H_
+#define _TUSB_MIDI_HOST_SMF_H_
+
+#include "usb_midi_host.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+//--------------------------------------------------------------------+
+// Standard MIDI File Player Configuration
+//--------------------------------------------------------------------+
+// The player sends the events of a type 0 or type 1 Standard MIDI File
+// to one cable of a device through the OUT schedule, so it requires
+// CFG_MIDI_HOST_TX_SCHEDULE.
+
+// Maximum number of tracks in a file the player can play
+#ifndef CFG_MIDI_HOST_SMF_MAX_TRACKS
+#define CFG_MIDI_HOST_SMF_MAX_TRACKS 16
+#endif
+
+// How far ahead of time the player schedules events. It must be longer
+// than the longest time between calls to tuh_midi_smf_task() plus the
+// output latency offset of the device, and the device OUT schedule must
+// be long enough to hold all events this far ahead.
+#ifndef CFG_MIDI_HOST_SMF_LOOKAHEAD_US
+#define CFG_MIDI_HOST_SMF_LOOKAHEAD_US 20000
+#endif
+
+// The parse state of one track. The player parses each track only as far
+// as the next event, so it does not need any memory for the file contents.
+typedef struct
+{
+  uint8_t const *next;    // first byte after the pending event
+  uint8_t const *end;     // first byte after the track chunk
+  uint32_t tick;          // time of the pending event from the start of the file
+  uint8_t running_status;
+  uint8_t status;         // status byte of the pending event or 0 if the track has ended
+  uint8_t data[2];        // data bytes of a pending channel message
+  uint8_t meta_type;      // type of a pending meta event
+  uint8_t const *bytes;   // data of a pending SysEx or meta event
+  uint32_t len;           // number of bytes at bytes
+} tuh_midi_smf_track_t;
+
+typedef struct
+{
+  tuh_midi_smf_track_t track[CFG_MIDI_HOST_SMF_MAX_TRACKS];
+  uint8_t num_tracks;
+  int16_t division;       // the division field of the header chunk
+  uint8_t dev_addr;
+  uint8_t cable;
+  bool playing;
+  uint32_t start_us;      // the driver time of tick 0
+  uint32_t tempo;         // microseconds per quarter note
+  uint32_t tempo_tick;    // time of the last tempo change in ticks
+  uint64_t tempo_us;      // time of the last tempo change in microseconds from tick 0
+  uint32_t sysex_sent;    // number of bytes of the pending SysEx event already scheduled
+} tuh_midi_smf_player_t;
+
+//--------------------------------------------------------------------+
+// Standard MIDI File Player API
+//--------------------------------------------------------------------+
+#if CFG_MIDI_HOST_TX_SCHEDULE
+// Prepare the player to play the Standard MIDI File of len bytes at smf.
+// The file stays where it is; it can be in RAM or in memory mapped flash,
+// and it must stay there until the player is done with it.
+// Returns false if the file is not a type 0 or type 1 Standard MIDI File.
+bool tuh_midi_smf_open(tuh_midi_smf_player_t *player, uint8_t const *smf, uint32_t len);
+
+// Start playing the file on cable of the device at dev_addr. The first
+// tick of the file plays at start_us on the tuh_midi_time_us() timebase.
+// To play the file again from the start, call tuh_midi_smf_open() first.
+void tuh_midi_smf_play(tuh_midi_smf_player_t *player, uint8_t dev_addr, uint8_t cable, uint32_t start_us);
+
+// Stop scheduling events. Events already scheduled are still sent.
+void tuh_midi_smf_stop(tuh_midi_smf_player_t *player);
+
+// Schedule the events that are due within CFG_MIDI_HOST_SMF_LOOKAHEAD_US.
+// Call this and tuh_midi_task() from the application main loop.
+// Returns true while the player is playing.
+bool tuh_midi_smf_task(tuh_midi_smf_player_t *player);
+#endif
+
+//--------------------------------------------------------------------+
+// Standard MIDI File Recorder Configuration
+//--------------------------------------------------------------------+
+// The recorder writes the packets received on one cable of a device to
+// a type 0 Standard MIDI File with 1 ms ticks (25 frames per second,
+// 40 ticks per frame). It reads the packets from the RX tap, so it
+// requires CFG_MIDI_HOST_RX_TAP. It only records channel messages and
+// SysEx messages; the file format has no place for real time messages.
+
+// The recorder writes the file in blocks of this many bytes
+#ifndef CFG_MIDI_HOST_SMF_BLOCK_BYTES
+#define CFG_MIDI_HOST_SMF_BLOCK_BYTES 256
+#endif
+
+// Write len bytes at data to the file at offset. The recorder writes
+// the file in order, except that tuh_midi_smf_record_stop() writes the
+// 4 byte track chunk length at offset 18 last. Return false if the write
+// failed; the recorder then stops.
+typedef bool (*tuh_midi_smf_sink_t)(void *context, uint32_t offset, uint8_t const *data, uint32_t len);
+
+typedef struct
+{
+  tuh_midi_smf_sink_t sink;
+  void *context;
+  uint32_t offset;        // file offset of block[0]
+  uint32_t block_len;     // number of bytes in block
+  uint32_t last_us;       // the driver time of the last event written
+  uint32_t rem_us;        // time since the last event that is not yet a whole tick
+  uint8_t dev_addr;
+  uint8_t cable;
+  uint8_t running_status;
+  bool in_sysex;
+  bool recording;
+  uint8_t block[CFG_MIDI_HOST_SMF_BLOCK_BYTES];
+} tuh_midi_smf_recorder_t;
+
+//--------------------------------------------------------------------+
+// Standard MIDI File Recorder API
+//--------------------------------------------------------------------+
+#if CFG_MIDI_HOST_RX_TAP
+// Start recording the packets received on cable of the device at dev_addr.
+// The recorder writes the file through sink. Only one recorder can run at
+// a time because it is the consumer of the RX tap.
+// Returns false if writing the file header failed.
+bool tuh_midi_smf_record_start(tuh_midi_smf_recorder_t *recorder, tuh_midi_smf_sink_t sink, void *context, uint8_t dev_addr, uint8_t cable);
+
+// Write the packets received since the last call to the file. Call this
+// from the application main loop often enough that the RX tap does not fill.
+// Returns false if the recorder is not recording.
+bool tuh_midi_smf_record_task(tuh_midi_smf_recorder_t *recorder);
+
+// Write the rest of the file, set the track chunk length and stop recording.
+// Returns the length of the file or 0 if a write failed.
+uint32_t tuh_midi_smf_record_stop(tuh_midi_smf_recorder_t *recorder);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TUSB_MIDI_HOST_SMF_H_ */
@@ -0,0 +1,246 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "tusb_option.h"
+
+#if (TUSB_OPT_HOST_ENABLED)
+
+#include "usb_midi_host_sysex.h"
+#include "class/midi/midi.h"
+#include <string.h>
+
+//--------------------------------------------------------------------+
+// Unpacking
+//--------------------------------------------------------------------+
+bool tuh_midi_sysex_unpack_init(tuh_midi_sysex_unpacker_t *unpacker, uint8_t scheme, uint8_t header_len, uint8_t trailer_len)
+{
+  if (trailer_len > TUH_MIDI_SYSEX_MAX_TRAILER)
+    return false;
+  unpacker->scheme = scheme;
+  unpacker->header_len = header_len;
+  unpacker->trailer_len = trailer_len;
+  unpacker->skip = header_len;
+  unpacker->nheld = 0;
+  unpacker->count = 0;
+  unpacker->msbs = 0;
+  return true;
+}
+
+// Return the number of SysEx bytes in a packet
+static inline uint8_t sysex_bytes(uint8_t const *packet)
+{
+  switch (packet[0] & 0xf)
+  {
+    case MIDI_CIN_SYSEX_START:
+    case MIDI_CIN_SYSEX_END_3BYTE:
+      return 3;
+    case MIDI_CIN_SYSEX_END_2BYTE:
+      return 2;
+    case MIDI_CIN_SYSEX_END_1BYTE:
+    case MIDI_CIN_1BYTE_DATA:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+uint32_t tuh_midi_sysex_unpack(tuh_midi_sysex_unpacker_t *unpacker, uint8_t const *packets, uint32_t npackets, uint8_t *out)
+{
+  uint8_t *const start = out;
+  uint8_t count = unpacker->count;
+  uint8_t msbs = unpacker->msbs;
+  bool const nibbles = unpacker->scheme >= TUH_MIDI_SYSEX_PACK_NIBBLE_LO_HI;
+  uint8_t const group_len = nibbles ? 2 : 8;
+  for (; npackets; npackets--, packets += 4)
+  {
+    uint8_t const nbytes = sysex_bytes(packets);
+    for (uint8_t idx = 1; idx <= nbytes; idx++)
+    {
+      uint8_t const data_byte = packets[idx];
+      if (data_byte & 0x80)
+      {
+        // F0 and F7 start a new message; real time messages are ignored
+        if (data_byte == MIDI_STATUS_SYSEX_START || data_byte == MIDI_STATUS_SYSEX_END)
+        {
+          count = 0;
+          unpacker->skip = unpacker->header_len;
+          unpacker->nheld = 0; // the held bytes were the trailer
+        }
+        continue;
+      }
+      if (unpacker->skip)
+      {
+        --unpacker->skip;
+        continue;
+      }
+      uint8_t one_byte = data_byte;
+      if (unpacker->trailer_len)
+      {
+        // Delay the bytes by trailer_len so the trailer is never unpacked
+        if (unpacker->nheld < unpacker->trailer_len)
+        {
+          unpacker->held[unpacker->nheld++] = data_byte;
+          continue;
+        }
+        one_byte = unpacker->held[0];
+        memmove(unpacker->held, unpacker->held + 1, unpacker->trailer_len - 1u);
+        unpacker->held[unpacker->trailer_len - 1] = data_byte;
+      }
+      if (count == 0)
+      {
+        msbs = one_byte;
+      }
+      else
+      {
+        switch (unpacker->scheme)
+        {
+          case TUH_MIDI_SYSEX_PACK_87:
+            *out++ = (uint8_t)(one_byte | ((msbs << (8 - count)) & 0x80));
+            break;
+          case TUH_MIDI_SYSEX_PACK_87_REVERSED:
+            *out++ = (uint8_t)(one_byte | ((msbs << count) & 0x80));
+            break;
+          case TUH_MIDI_SYSEX_PACK_NIBBLE_LO_HI:
+            *out++ = (uint8_t)((msbs & 0xf) | (one_byte << 4));
+            break;
+          default:
+            *out++ = (uint8_t)((msbs << 4) | (one_byte & 0xf));
+            break;
+        }
+      }
+      if (++count == group_len)
+        count = 0;
+    }
+  }
+  unpacker->count = count;
+  unpacker->msbs = msbs;
+  return (uint32_t)(out - start);
+}
+
+//--------------------------------------------------------------------+
+// Packing
+//--------------------------------------------------------------------+
+void tuh_midi_sysex_pack_init(tuh_midi_sysex_packer_t *packer, uint8_t scheme, uint8_t cable)
+{
+  packer->scheme = scheme;
+  packer->cable = cable;
+  packer->count = 0;
+  packer->npending = 0;
+}
+
+// Add one byte to the message. The message always ends with F7, so a
+// full packet before it is a SysEx start or continue packet.
+static inline uint32_t put_byte(tuh_midi_sysex_packer_t *packer, uint8_t one_byte, uint8_t *packets)
+{
+  packer->pending[packer->npending++] = one_byte;
+  if (packer->npending < 3)
+    return 0;
+  packets[0] = (uint8_t)((packer->cable << 4) | MIDI_CIN_SYSEX_START);
+  packets[1] = packer->pending[0];
+  packets[2] = packer->pending[1];
+  packets[3] = packer->pending[2];
+  packer->npending = 0;
+  return 1;
+}
+
+// Add the partial 8 to 7 group, if any, to the message
+static uint32_t flush_group(tuh_midi_sysex_packer_t *packer, uint8_t *packets)
+{
+  uint32_t npackets = 0;
+  if (packer->count != 0)
+  {
+    for (uint8_t idx = 0; idx <= packer->count; idx++)
+    {
+      npackets += put_byte(packer, packer->group[idx], packets + 4*npackets);
+    }
+    packer->count = 0;
+  }
+  return npackets;
+}
+
+uint32_t tuh_midi_sysex_pack_raw(tuh_midi_sysex_packer_t *packer, uint8_t const *bytes, uint32_t len, uint8_t *packets)
+{
+  uint32_t npackets = flush_group(packer, packets);
+  for (; len; len--)
+  {
+    npackets += put_byte(packer, *bytes++, packets + 4*npackets);
+  }
+  return npackets;
+}
+
+uint32_t tuh_midi_sysex_pack(tuh_midi_sysex_packer_t *packer, uint8_t const *data, uint32_t len, uint8_t *packets)
+{
+  uint32_t npackets = 0;
+  switch (packer->scheme)
+  {
+    case TUH_MIDI_SYSEX_PACK_87:
+    case TUH_MIDI_SYSEX_PACK_87_REVERSED:
+    {
+      uint8_t const reversed = packer->scheme == TUH_MIDI_SYSEX_PACK_87_REVERSED;
+      for (; len; len--)
+      {
+        uint8_t const one_byte = *data++;
+        if (packer->count == 0)
+          packer->group[0] = 0;
+        uint8_t const bit = reversed ? (uint8_t)(6 - packer->count) : packer->count;
+        packer->group[0] |= (uint8_t)((one_byte >> 7) << bit);
+        packer->group[++packer->count] = one_byte & 0x7f;
+        if (packer->count == 7)
+          npackets += flush_group(packer, packets + 4*npackets);
+      }
+      break;
+    }
+    case TUH_MIDI_SYSEX_PACK_NIBBLE_LO_HI:
+      for (; len; len--, data++)
+      {
+        npackets += put_byte(packer, *data & 0xf, packets + 4*npackets);
+        npackets += put_byte(packer, *data >> 4, packets + 4*npackets);
+      }
+      break;
+    default:
+      for (; len; len--, data++)
+      {
+        npackets += put_byte(packer, *data >> 4, packets + 4*npackets);
+        npackets += put_byte(packer, *data & 0xf, packets + 4*npackets);
+      }
+      break;
+  }
+  return npackets;
+}
+
+uint32_t tuh_midi_sysex_pack_end(tuh_midi_sysex_packer_t *packer, uint8_t *packets)
+{
+  uint32_t npackets = flush_group(packer, packets);
+  uint8_t *packet = packets + 4*npackets;
+  uint8_t const n = packer->npending;
+  packet[0] = (uint8_t)((packer->cable << 4) | (MIDI_CIN_SYSEX_END_1BYTE + n));
+  packet[1] = n > 0 ? packer->pending[0] : MIDI_STATUS_SYSEX_END;
+  packet[2] = n > 1 ? packer->pending[1] : (n == 1 ? MIDI_STATUS_SYSEX_END : 0);
+  packet[3] = n == 2 ? MIDI_STATUS_SYSEX_END : 0;
+  packer->npending = 0;
+  return npackets + 1;
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef _TUSB_MIDI_HOST_SYSEX_H_
+#define _TUSB_MIDI_HOST_SYSEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+//--------------------------------------------------------------------+
+// SysEx 8-bit Data Packing
+//--------------------------------------------------------------------+
+// SysEx data bytes only have 7 bits, so vendor dumps pack 8-bit data
+// into them. These functions unpack 8-bit data straight from received
+// USB MIDI SysEx packets and pack 8-bit data straight into USB MIDI
+// SysEx packets, with no intermediate byte buffer.
+
+// The largest number of data bytes before F7 that the unpacker can skip
+#define TUH_MIDI_SYSEX_MAX_TRAILER 4
+
+// Packing schemes
+enum
+{
+  // Groups of up to 7 bytes, each led by a byte that holds their most
+  // significant bits; bit n of the leading byte is bit 7 of byte n
+  TUH_MIDI_SYSEX_PACK_87,
+  // The same, but bit 6-n of the leading byte is bit 7 of byte n
+  TUH_MIDI_SYSEX_PACK_87_REVERSED,
+  // Each byte sent as two bytes, low nibble first
+  TUH_MIDI_SYSEX_PACK_NIBBLE_LO_HI,
+  // Each byte sent as two bytes, high nibble first
+  TUH_MIDI_SYSEX_PACK_NIBBLE_HI_LO,
+};
+
+typedef struct
+{
+  uint8_t scheme;
+  uint8_t header_len;   // data bytes after F0 that are not packed
+  uint8_t trailer_len;  // data bytes before F7 that are not packed
+  uint8_t skip;         // header bytes of the current message still to skip
+  uint8_t nheld;        // bytes in held
+  uint8_t held[TUH_MIDI_SYSEX_MAX_TRAILER]; // the last bytes, which may be the trailer
+  uint8_t count;        // bytes of the current group received so far
+  uint8_t msbs;         // the leading byte or first nibble of the current group
+} tuh_midi_sysex_unpacker_t;
+
+typedef struct
+{
+  uint8_t scheme;
+  uint8_t cable;
+  uint8_t count;        // bytes in the current group
+  uint8_t npending;     // bytes in pending
+  uint8_t group[8];     // leading byte and data bytes of the current group
+  uint8_t pending[3];   // bytes not yet in a packet
+} tuh_midi_sysex_packer_t;
+
+// The largest number of packets tuh_midi_sysex_pack() writes for len bytes
+#define TUH_MIDI_SYSEX_PACK_PACKETS(len) ((2*(len) + 12) / 3)
+// The largest number of packets tuh_midi_sysex_pack_raw() writes for len
+// bytes: the partial group (up to 7 bytes) and the pending bytes (up to 2)
+// come out first
+#define TUH_MIDI_SYSEX_PACK_RAW_PACKETS(len) (((len) + 9) / 3)
+
+//--------------------------------------------------------------------+
+// SysEx 8-bit Data Packing API
+//--------------------------------------------------------------------+
+// Prepare to unpack SysEx messages. The first header_len data bytes after
+// each F0, such as the manufacturer ID and the command, and the last
+// trailer_len data bytes before each F7, such as a checksum, are not
+// unpacked. trailer_len can be up to TUH_MIDI_SYSEX_MAX_TRAILER.
+// Returns false if trailer_len is too big.
+bool tuh_midi_sysex_unpack_init(tuh_midi_sysex_unpacker_t *unpacker, uint8_t scheme, uint8_t header_len, uint8_t trailer_len);
+
+// Unpack the data in npackets USB MIDI packets at packets to out, which
+// must have room for 3 bytes per packet. Pass the packets of one cable in
+// the order they were received; for example, from tuh_midi_packet_read()
+// or straight from tuh_midi_packet_read_peek(). Packets that are not part
+// of a SysEx message, real time messages, F0 and F7 do not produce data.
+// The unpacker holds back the last trailer_len bytes until it knows they
+// are not the trailer, so the data of a group can come out one call later.
+// Returns the number of bytes written to out.
+uint32_t tuh_midi_sysex_unpack(tuh_midi_sysex_unpacker_t *unpacker, uint8_t const *packets, uint32_t npackets, uint8_t *out);
+
+// Prepare to pack a SysEx message for cable
+void tuh_midi_sysex_pack_init(tuh_midi_sysex_packer_t *packer, uint8_t scheme, uint8_t cable);
+
+// Add len bytes that are not packed, such as F0, the header or a
+// checksum, to the message. This ends a partial group of packed data.
+// Returns the number of packets written to packets, which must have room
+// for TUH_MIDI_SYSEX_PACK_RAW_PACKETS(len) packets.
+uint32_t tuh_midi_sysex_pack_raw(tuh_midi_sysex_packer_t *packer, uint8_t const *bytes, uint32_t len, uint8_t *packets);
+
+// Pack len bytes of 8-bit data into the message. Returns the number of
+// packets written to packets, which must have room for
+// TUH_MIDI_SYSEX_PACK_PACKETS(len) packets.
+uint32_t tuh_midi_sysex_pack(tuh_midi_sysex_packer_t *packer, uint8_t const *data, uint32_t len, uint8_t *packets);
+
+// Pack the last partial group, if any, and end the message with F7.
+// Returns the number of packets written to packets, which must have room
+// for 4 packets.
+uint32_t tuh_midi_sysex_pack_end(tuh_midi_sysex_packer_t *packer, uint8_t *packets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TUSB_MIDI_HOST_SYSEX_H_ */